@@ -0,0 +1,583 @@
+#include "commands.h"
+#include "condition_parser.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+string ParseEvent(istream &is) {
+    string event;
+
+    while (is.peek() == ' ')
+        is.ignore(1);
+
+    getline(is, event);
+    return event;
+}
+
+namespace {
+
+// Retention [off | age <days> | floor <date> | auto]...
+RetentionPolicy ParseRetention(istream &is) {
+    RetentionPolicy policy;
+
+    for (string option; is >> option;) {
+        if (option == "off") {
+            policy = RetentionPolicy();
+        } else if (option == "age") {
+            int days;
+            if (!(is >> days) || days < 0) {
+                throw logic_error("Wrong retention age");
+            }
+            policy.max_age_days = days;
+        } else if (option == "floor") {
+            policy.floor = ParseDate(is);
+        } else if (option == "auto") {
+            policy.automatic = true;
+        } else {
+            throw logic_error("Unknown retention option: " + option);
+        }
+    }
+
+    return policy;
+}
+
+// Compress [off | <idle writes>]
+optional<uint64_t> ParseCompression(istream &is) {
+    string option;
+    if (!(is >> option) || option == "off")
+        return nullopt;
+
+    istringstream option_stream(option);
+    uint64_t idle_writes;
+    if (option[0] == '-' || !(option_stream >> idle_writes) || !option_stream.eof()) {
+        throw logic_error("Wrong compression option: " + option);
+    }
+    return idle_writes;
+}
+
+// Spill [off | <budget bytes> <directory>]
+void ParseSpill(istream &is, Command &command) {
+    string option;
+    if (!(is >> option) || option == "off")
+        return;
+
+    istringstream option_stream(option);
+    size_t budget;
+    if (option[0] == '-' || !(option_stream >> budget) || !option_stream.eof()) {
+        throw logic_error("Wrong memory budget: " + option);
+    }
+    if (!(is >> command.spill_directory)) {
+        throw logic_error("Spill directory is missing");
+    }
+    command.memory_budget = budget;
+}
+
+// Optional AS OF <version> in front of the arguments
+optional<uint64_t> ParseAsOf(istream &is) {
+    const auto start = is.tellg();
+
+    string word;
+    if (!(is >> word) || word != "AS") {
+        is.clear();
+        is.seekg(start);
+        return nullopt;
+    }
+
+    uint64_t version;
+    if (!(is >> word) || word != "OF" || !(is >> ws) || is.peek() == '-' || !(is >> version)) {
+        throw logic_error("Wrong AS OF version");
+    }
+    return version;
+}
+
+// <date>/<event bytes in hex>, as PrintPage writes it
+FindCursor ParseCursor(const string &token) {
+    istringstream is(token);
+    FindCursor cursor{ParseDate(is), ""};
+
+    string digits;
+    if (is.get() != '/' || !(is >> digits) || digits.size() % 2 != 0) {
+        throw logic_error("Wrong cursor: " + token);
+    }
+
+    for (size_t i = 0; i < digits.size(); i += 2) {
+        const string digit_pair = digits.substr(i, 2);
+        if (!all_of(digit_pair.begin(), digit_pair.end(), [](unsigned char c) { return isxdigit(c); })) {
+            throw logic_error("Wrong cursor: " + token);
+        }
+        cursor.event += static_cast<char>(stoi(digit_pair, nullptr, 16));
+    }
+    return cursor;
+}
+
+// Optional DESC, OFFSET <count>, LIMIT <count> and AFTER <cursor> in any order in front of the condition
+FindOptions ParseFindOptions(istream &is) {
+    FindOptions options;
+
+    while (true) {
+        const auto start = is.tellg();
+
+        string word;
+        if (!(is >> word) || (word != "DESC" && word != "OFFSET" && word != "LIMIT" && word != "AFTER")) {
+            is.clear();
+            is.seekg(start);
+            return options;
+        }
+
+        if (word == "DESC") {
+            options.descending = true;
+            continue;
+        }
+
+        if (word == "AFTER") {
+            string token;
+            if (!(is >> token)) {
+                throw logic_error("Cursor is missing");
+            }
+            options.after = ParseCursor(token);
+            continue;
+        }
+
+        size_t count;
+        if (!(is >> ws) || is.peek() == '-' || !(is >> count)) {
+            throw logic_error("Wrong " + word + " count");
+        }
+
+        if (word == "LIMIT")
+            options.limit = count;
+        else
+            options.offset = count;
+    }
+}
+
+// Versions <count>
+size_t ParseVersionLimit(istream &is) {
+    size_t limit;
+    if (!(is >> ws) || is.peek() == '-' || !(is >> limit)) {
+        throw logic_error("Wrong version limit");
+    }
+    return limit;
+}
+
+// Poll, Unsubscribe, View and DropView <id>
+uint64_t ParseId(istream &is) {
+    uint64_t id;
+    if (!(is >> ws) || is.peek() == '-' || !(is >> id)) {
+        throw logic_error("Wrong id");
+    }
+    return id;
+}
+
+// taking the deltas of a subscription empties its queue, so Poll writes too
+bool IsReadOnlyCommand(CommandType type) {
+    return type != CommandType::Add && type != CommandType::Del
+           && type != CommandType::Retention && type != CommandType::Expire
+           && type != CommandType::Compress && type != CommandType::Spill
+           && type != CommandType::Versions && type != CommandType::Subscribe
+           && type != CommandType::Poll && type != CommandType::Unsubscribe
+           && type != CommandType::CreateView && type != CommandType::DropView;
+}
+
+}
+
+Command ParseCommand(const string &line) {
+    istringstream is(line);
+    Command result;
+
+    string command;
+    is >> command;
+    if (command == "Add") {
+        result.type = CommandType::Add;
+        result.date = ParseDate(is);
+        result.event = ParseEvent(is);
+    } else if (command == "Print") {
+        result.type = CommandType::Print;
+    } else if (command == "Del") {
+        result.type = CommandType::Del;
+        result.condition = ParseCondition(is);
+    } else if (command == "Find") {
+        result.type = CommandType::Find;
+        result.version = ParseAsOf(is);
+        result.find_options = ParseFindOptions(is);
+        result.condition = ParseCondition(is);
+    } else if (command == "Count") {
+        result.type = CommandType::Count;
+        result.condition = ParseCondition(is);
+    } else if (command == "Exists") {
+        result.type = CommandType::Exists;
+        result.condition = ParseCondition(is);
+    } else if (command == "Last") {
+        result.type = CommandType::Last;
+        result.version = ParseAsOf(is);
+        result.date = ParseDate(is);
+        if (!(is >> ws).eof())
+            result.condition = ParseCondition(is);
+    } else if (command == "Retention") {
+        result.type = CommandType::Retention;
+        result.retention = ParseRetention(is);
+    } else if (command == "Expire") {
+        result.type = CommandType::Expire;
+    } else if (command == "Explain") {
+        result.type = CommandType::Explain;
+        result.condition = ParseCondition(is);
+    } else if (command == "Memory") {
+        result.type = CommandType::Memory;
+    } else if (command == "Compress") {
+        result.type = CommandType::Compress;
+        result.idle_writes = ParseCompression(is);
+    } else if (command == "Spill") {
+        result.type = CommandType::Spill;
+        ParseSpill(is, result);
+    } else if (command == "Version") {
+        result.type = CommandType::Version;
+    } else if (command == "Versions") {
+        result.type = CommandType::Versions;
+        result.version_limit = ParseVersionLimit(is);
+    } else if (command == "Subscribe") {
+        result.type = CommandType::Subscribe;
+        result.condition = ParseCondition(is);
+    } else if (command == "Poll") {
+        result.type = CommandType::Poll;
+        result.id = ParseId(is);
+    } else if (command == "Unsubscribe") {
+        result.type = CommandType::Unsubscribe;
+        result.id = ParseId(is);
+    } else if (command == "CreateView") {
+        result.type = CommandType::CreateView;
+        result.condition = ParseCondition(is);
+    } else if (command == "View") {
+        result.type = CommandType::View;
+        result.id = ParseId(is);
+    } else if (command == "DropView") {
+        result.type = CommandType::DropView;
+        result.id = ParseId(is);
+    } else if (!command.empty()) {
+        throw logic_error("Unknown command: " + command);
+    }
+
+    return result;
+}
+
+namespace {
+
+bool IsSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool IsBlank(const char *current, const char *end) {
+    return all_of(current, end, IsSpace);
+}
+
+// Lines which the fast path does not handle, malformed ones are reported by the status
+ParseStatus ParseWithFallback(string_view line, Command &command) {
+    try {
+        command = ParseCommand(string(line));
+    } catch (logic_error &) {
+        return ParseStatus::WrongArguments;
+    }
+    return ParseStatus::Ok;
+}
+
+// True if the next word of the line is AS
+bool StartsWithAs(const char *current, const char *end) {
+    while (current != end && IsSpace(*current)) {
+        ++current;
+    }
+    return end - current >= 2 && current[0] == 'A' && current[1] == 'S'
+           && (end - current == 2 || IsSpace(current[2]));
+}
+
+}
+
+ParseStatus TryParseCommand(string_view line, Command &command) {
+    command = Command();
+
+    const char *current = line.data();
+    const char *const end = line.data() + line.size();
+
+    while (current != end && IsSpace(*current)) {
+        ++current;
+    }
+    const char *name_begin = current;
+    while (current != end && !IsSpace(*current)) {
+        ++current;
+    }
+    const string_view name(name_begin, current - name_begin);
+
+    // Last AS OF and Last with a condition go through the throwing parser with the other rare forms
+    if (name == "Add" || (name == "Last" && !StartsWithAs(current, end))) {
+        const DateParseResult result = ParseDate(current, end, command.date);
+        if (result.error != DateError::None)
+            return ParseStatus::WrongDate;
+
+        if (name == "Last") {
+            if (!IsBlank(result.ptr, end))
+                return ParseWithFallback(line, command);
+
+            command.type = CommandType::Last;
+            return ParseStatus::Ok;
+        }
+
+        current = result.ptr;
+        while (current != end && *current == ' ') {
+            ++current;
+        }
+
+        // the event runs to the end of the line as ParseEvent reads it
+        command.type = CommandType::Add;
+        command.event.assign(current, find(current, end, '\n'));
+        return ParseStatus::Ok;
+    }
+
+    if (name.empty())
+        return ParseStatus::Ok;
+
+    if (name == "Print") {
+        command.type = CommandType::Print;
+        return ParseStatus::Ok;
+    }
+    if (name == "Expire") {
+        command.type = CommandType::Expire;
+        return ParseStatus::Ok;
+    }
+    if (name == "Memory") {
+        command.type = CommandType::Memory;
+        return ParseStatus::Ok;
+    }
+    if (name == "Version") {
+        command.type = CommandType::Version;
+        return ParseStatus::Ok;
+    }
+
+    if (name != "Del" && name != "Find" && name != "Count" && name != "Exists"
+        && name != "Explain" && name != "Retention" && name != "Compress"
+        && name != "Spill" && name != "Versions" && name != "Last" && name != "Subscribe"
+        && name != "Poll" && name != "Unsubscribe" && name != "CreateView" && name != "View"
+        && name != "DropView")
+        return ParseStatus::UnknownCommand;
+
+    return ParseWithFallback(line, command);
+}
+
+bool IsReadOnlyCommand(const Command &command) {
+    return IsReadOnlyCommand(command.type);
+}
+
+namespace {
+
+// The count is the number of printed entries, for a Find with OFFSET or LIMIT as well
+void PrintEntries(const vector<pair<Date, string>> &entries, ostream &os) {
+    for (const auto &entry : entries) {
+        os << entry.first << " " << entry.second << endl;
+    }
+    os << "Found " << entries.size() << " entries" << endl;
+}
+
+// A page cut short by LIMIT is followed by the cursor to pass to AFTER for the next one
+void PrintPage(const FindResult &page, ostream &os) {
+    PrintEntries(page.entries, os);
+
+    // events may hold spaces, so the cursor carries the bytes of its event in hex
+    if (page.cursor) {
+        static const char DIGITS[] = "0123456789abcdef";
+        os << "Cursor " << page.cursor->date << "/";
+        for (unsigned char c : page.cursor->event) {
+            os << DIGITS[c >> 4] << DIGITS[c & 15];
+        }
+        os << endl;
+    }
+}
+
+void PrintExplanation(const QueryExplanation &explanation, ostream &os) {
+    const QueryPlan &plan = explanation.plan;
+
+    os << "Plan: ";
+    switch (plan.path) {
+        case AccessPath::Nothing:
+            os << "empty date range";
+            break;
+        case AccessPath::FullScan:
+            os << "full scan";
+            break;
+        case AccessPath::DateRangeSeek:
+            os << "date range seek " << plan.range;
+            break;
+    }
+    os << ", evaluated " << (plan.date_only ? "per bucket" : "per entry") << endl;
+
+    os << "Estimated: " << llround(plan.estimated_rows) << " matching of "
+       << llround(plan.estimated_touched) << " touched entries" << endl;
+    os << "Actual: " << explanation.rows_matched << " matching of "
+       << explanation.rows_touched << " touched entries in "
+       << explanation.buckets_touched << " buckets" << endl;
+}
+
+// Replies for a version which is not kept, returns false then
+bool CheckVersion(const Database &db, const Command &command, ostream &os) {
+    if (!command.version || db.HasVersion(*command.version))
+        return true;
+
+    os << "Unknown version " << *command.version << endl;
+    return false;
+}
+
+// One line per delta, + for an entry which started matching and - for one which stopped
+void PrintDeltas(const vector<SubscriptionDelta> &deltas, ostream &os) {
+    for (const auto &delta : deltas) {
+        os << (delta.added ? "+ " : "- ") << delta.date << " " << delta.event << endl;
+    }
+    os << "Found " << deltas.size() << " changes" << endl;
+}
+
+void PrintMemoryReport(const MemoryReport &report, ostream &os) {
+    os << "Memory: " << report.Total() << " bytes" << endl;
+    os << "Date nodes: " << report.date_nodes << endl;
+    os << "Event data: " << report.buckets.data << endl;
+    os << "Event offsets: " << report.buckets.offsets << endl;
+    os << "Event prefixes: " << report.buckets.prefixes << endl;
+    os << "Dedup index: " << report.buckets.index << endl;
+    os << "Compressed events: " << report.buckets.packed << endl;
+    os << "Segment index: " << report.segments << endl;
+    os << "Versions: " << report.versions << endl;
+    os << "Subscriptions: " << report.subscriptions << endl;
+    os << "Statistics: " << report.statistics << endl;
+}
+
+}
+
+void ExecuteCommand(Database &db, const Command &command, ostream &os) {
+    // a run of Adds stays in the write buffer until a command which may look at it
+    if (command.type != CommandType::Add && command.type != CommandType::Empty)
+        db.Flush();
+
+    switch (command.type) {
+        case CommandType::Empty:
+            break;
+        case CommandType::Add:
+            db.AddBuffered(*command.date, command.event);
+            break;
+        case CommandType::Print:
+            db.Print(os);
+            break;
+        case CommandType::Del: {
+            int count = db.RemoveIf(command.condition);
+            os << "Removed " << count << " entries" << endl;
+            break;
+        }
+        case CommandType::Find:
+            if (!CheckVersion(db, command, os))
+                break;
+            if (command.version)
+                PrintPage(db.FindIf(command.condition, *command.version, command.find_options), os);
+            else
+                PrintPage(db.FindIf(command.condition, command.find_options), os);
+            break;
+        case CommandType::Count:
+            os << "Found " << db.CountIf(command.condition) << " entries" << endl;
+            break;
+        case CommandType::Exists:
+            os << (db.ExistsIf(command.condition) ? "Found" : "No entries") << endl;
+            break;
+        case CommandType::Last:
+            if (!CheckVersion(db, command, os))
+                break;
+            try {
+                if (command.condition && command.version)
+                    os << db.Last(*command.date, command.condition, *command.version) << endl;
+                else if (command.condition)
+                    os << db.Last(*command.date, command.condition) << endl;
+                else
+                    os << (command.version ? db.Last(*command.date, *command.version) : db.Last(*command.date)) << endl;
+            } catch (invalid_argument &) {
+                os << "No entries" << endl;
+            }
+            break;
+        case CommandType::Retention:
+            db.SetRetentionPolicy(command.retention);
+            break;
+        case CommandType::Expire:
+            os << "Removed " << db.Expire() << " entries" << endl;
+            break;
+        case CommandType::Explain:
+            PrintExplanation(db.Explain(command.condition), os);
+            break;
+        case CommandType::Memory:
+            PrintMemoryReport(db.MemoryUsage(), os);
+            break;
+        case CommandType::Compress:
+            db.SetCompression(command.idle_writes);
+            break;
+        case CommandType::Spill:
+            db.SetMemoryBudget(command.memory_budget, command.spill_directory);
+            break;
+        case CommandType::Version:
+            os << "Version " << db.GetVersion() << endl;
+            break;
+        case CommandType::Versions:
+            db.SetVersionLimit(command.version_limit);
+            break;
+        case CommandType::Subscribe:
+            os << "Subscription " << db.Subscribe(command.condition) << endl;
+            break;
+        case CommandType::Poll:
+            if (const auto deltas = db.TakeDeltas(command.id))
+                PrintDeltas(*deltas, os);
+            else
+                os << "Unknown subscription " << command.id << endl;
+            break;
+        case CommandType::Unsubscribe:
+            if (!db.Unsubscribe(command.id))
+                os << "Unknown subscription " << command.id << endl;
+            break;
+        case CommandType::CreateView:
+            os << "View " << db.CreateView(command.condition) << endl;
+            break;
+        case CommandType::View:
+            if (const auto view = db.ReadView(command.id)) {
+                os << "Found " << view->count << " entries" << endl;
+                if (view->latest)
+                    os << view->latest->first << " " << view->latest->second << endl;
+                else
+                    os << "No entries" << endl;
+            } else {
+                os << "Unknown view " << command.id << endl;
+            }
+            break;
+        case CommandType::DropView:
+            if (!db.DropView(command.id))
+                os << "Unknown view " << command.id << endl;
+            break;
+    }
+}
+
+bool IsBatchCommand(const Command &command) {
+    // a batch reads every bucket anyway, Find with options is left to stop early on its own
+    const FindOptions &options = command.find_options;
+    const bool plain_find = !command.version && !options.limit && options.offset == 0 && !options.descending
+                            && !options.after;
+    return (command.type == CommandType::Find && plain_find) || command.type == CommandType::Del;
+}
+
+void ExecuteBatch(Database &db, const vector<Command> &commands, ostream &os) {
+    if (commands.empty())
+        return;
+
+    vector<BatchQuery> queries;
+    for (const Command &command : commands) {
+        queries.push_back({command.type == CommandType::Del, command.condition});
+    }
+
+    const auto results = db.ExecuteBatch(queries);
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (queries[i].remove)
+            os << "Removed " << results[i].removed << " entries" << endl;
+        else
+            PrintEntries(results[i].entries, os);
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "database.h"
+#include "date.h"
+#include "node.h"
+
+enum class CommandType {
+    Empty, Add, Del, Find, Count, Exists, Last, Print, Retention, Expire, Explain, Memory, Compress, Spill,
+    Version, Versions, Subscribe, Poll, Unsubscribe, CreateView, View, DropView
+};
+
+// One parsed line of the command protocol
+struct Command {
+    CommandType type = CommandType::Empty;
+    std::optional<Date> date;
+    std::string event;
+    std::shared_ptr<Node> condition;
+    RetentionPolicy retention;
+    std::optional<uint64_t> idle_writes;
+    std::optional<size_t> memory_budget;
+    std::string spill_directory;
+    std::optional<uint64_t> version;    // Find and Last AS OF a past version
+    FindOptions find_options;           // Find DESC, OFFSET, LIMIT and AFTER
+    size_t version_limit = 0;
+    uint64_t id = 0;                    // subscription or view
+};
+
+std::string ParseEvent(std::istream &is);
+
+// Throws logic_error for malformed lines and unknown commands
+Command ParseCommand(const std::string &line);
+
+enum class ParseStatus {
+    Ok, UnknownCommand, WrongDate, WrongArguments
+};
+
+// Same as ParseCommand, but a malformed line is reported by the status instead of an exception.
+// Add and Last lines, which make up bulk feeds, are parsed straight from the characters,
+// conditions and retention options still go through the throwing parsers.
+ParseStatus TryParseCommand(std::string_view line, Command &command);
+
+// True for commands which do not modify the database
+bool IsReadOnlyCommand(const Command &command);
+
+// Writes the reply to os exactly as the stdin/stdout protocol does. Adds are buffered,
+// every other command flushes the buffer first and so sees all of the Adds before it.
+void ExecuteCommand(Database &db, const Command &command, std::ostream &os);
+
+// True for commands which can be executed together by ExecuteBatch
+bool IsBatchCommand(const Command &command);
+
+// Executes a run of Find and Del commands in one pass over the database,
+// replies are the same as for executing them one by one
+void ExecuteBatch(Database &db, const std::vector<Command> &commands, std::ostream &os);
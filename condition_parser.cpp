@@ -1,4 +1,5 @@
 #include "condition_parser.h"
+#include "condition_simplifier.h"
 #include "date.h"
 #include "token.h"
 #include "node.h"
@@ -121,5 +122,5 @@ shared_ptr<Node> ParseCondition(istream &is) {
         throw logic_error("Unexpected tokens after condition");
     }
 
-    return top_node;
+    return SimplifyCondition(top_node);
 }
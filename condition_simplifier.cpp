@@ -0,0 +1,290 @@
+#include "condition_simplifier.h"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+template<class T>
+struct Bound {
+    T value;
+    bool inclusive;
+};
+
+// Comparison of one column (date or event) with a constant
+template<class T>
+struct ColumnComparison {
+    Comparison comparison;
+    T value;
+};
+
+template<class T>
+bool IsAbove(const T &value, const Bound<T> &from) {
+    return from.value < value || (from.value == value && from.inclusive);
+}
+
+template<class T>
+bool IsBelow(const T &value, const Bound<T> &to) {
+    return value < to.value || (value == to.value && to.inclusive);
+}
+
+template<class T>
+void SortUnique(vector<T> &values) {
+    sort(values.begin(), values.end());
+    values.erase(unique(values.begin(), values.end()), values.end());
+}
+
+// Conjunction of comparisons as an interval with holes, nullopt when nothing satisfies it
+template<class T>
+optional<vector<ColumnComparison<T>>> MergeAnd(const vector<ColumnComparison<T>> &comparisons) {
+    optional<Bound<T>> from;
+    optional<Bound<T>> to;
+    vector<T> excluded;
+
+    auto restrict_from = [&from](const Bound<T> &bound) {
+        if (!from || from->value < bound.value || (from->value == bound.value && !bound.inclusive))
+            from = bound;
+    };
+    auto restrict_to = [&to](const Bound<T> &bound) {
+        if (!to || bound.value < to->value || (bound.value == to->value && !bound.inclusive))
+            to = bound;
+    };
+
+    for (const auto &comparison : comparisons) {
+        switch (comparison.comparison) {
+            case Comparison::Less:
+                restrict_to({comparison.value, false});
+                break;
+            case Comparison::LessOrEqual:
+                restrict_to({comparison.value, true});
+                break;
+            case Comparison::Greater:
+                restrict_from({comparison.value, false});
+                break;
+            case Comparison::GreaterOrEqual:
+                restrict_from({comparison.value, true});
+                break;
+            case Comparison::Equal:
+                restrict_from({comparison.value, true});
+                restrict_to({comparison.value, true});
+                break;
+            case Comparison::NotEqual:
+                excluded.push_back(comparison.value);
+                break;
+        }
+    }
+
+    // holes outside of the interval are dropped, holes at its ends open it
+    SortUnique(excluded);
+    vector<T> holes;
+    for (const T &value : excluded) {
+        if ((from && !IsAbove(value, *from)) || (to && !IsBelow(value, *to)))
+            continue;
+
+        if (from && from->value == value) {
+            from->inclusive = false;
+        } else if (to && to->value == value) {
+            to->inclusive = false;
+        } else {
+            holes.push_back(value);
+        }
+    }
+
+    if (from && to && (to->value < from->value
+                       || (to->value == from->value && (!from->inclusive || !to->inclusive)))) {
+        return nullopt;
+    }
+
+    vector<ColumnComparison<T>> result;
+    if (from && to && from->value == to->value) {
+        result.push_back({Comparison::Equal, from->value});
+    } else {
+        if (from)
+            result.push_back({from->inclusive ? Comparison::GreaterOrEqual : Comparison::Greater, from->value});
+        if (to)
+            result.push_back({to->inclusive ? Comparison::LessOrEqual : Comparison::Less, to->value});
+    }
+    for (const T &value : holes) {
+        result.push_back({Comparison::NotEqual, value});
+    }
+
+    return result;
+}
+
+// Disjunction of comparisons as two rays and single points, nullopt when everything satisfies it
+template<class T>
+optional<vector<ColumnComparison<T>>> MergeOr(const vector<ColumnComparison<T>> &comparisons) {
+    optional<Bound<T>> below;
+    optional<Bound<T>> above;
+    vector<T> equal;
+    vector<T> excluded;
+
+    auto widen_below = [&below](const Bound<T> &bound) {
+        if (!below || below->value < bound.value || (below->value == bound.value && bound.inclusive))
+            below = bound;
+    };
+    auto widen_above = [&above](const Bound<T> &bound) {
+        if (!above || bound.value < above->value || (bound.value == above->value && bound.inclusive))
+            above = bound;
+    };
+
+    for (const auto &comparison : comparisons) {
+        switch (comparison.comparison) {
+            case Comparison::Less:
+                widen_below({comparison.value, false});
+                break;
+            case Comparison::LessOrEqual:
+                widen_below({comparison.value, true});
+                break;
+            case Comparison::Greater:
+                widen_above({comparison.value, false});
+                break;
+            case Comparison::GreaterOrEqual:
+                widen_above({comparison.value, true});
+                break;
+            case Comparison::Equal:
+                equal.push_back(comparison.value);
+                break;
+            case Comparison::NotEqual:
+                excluded.push_back(comparison.value);
+                break;
+        }
+    }
+
+    auto is_covered = [&below, &above](const T &value) {
+        return (below && IsBelow(value, *below)) || (above && IsAbove(value, *above));
+    };
+
+    // points inside of the rays are dropped, points at their ends close them
+    SortUnique(equal);
+    vector<T> points;
+    for (const T &value : equal) {
+        if (is_covered(value))
+            continue;
+
+        if (below && below->value == value) {
+            below->inclusive = true;
+        } else if (above && above->value == value) {
+            above->inclusive = true;
+        } else {
+            points.push_back(value);
+        }
+    }
+
+    // a single inequality covers everything the other comparisons may add except its own value
+    SortUnique(excluded);
+    if (excluded.size() > 1)
+        return nullopt;
+    if (excluded.size() == 1) {
+        const T &value = excluded.front();
+        if (is_covered(value) || binary_search(points.begin(), points.end(), value))
+            return nullopt;
+        return vector<ColumnComparison<T>>{{Comparison::NotEqual, value}};
+    }
+
+    if (below && above && (above->value < below->value
+                           || (above->value == below->value && (above->inclusive || below->inclusive)))) {
+        return nullopt;
+    }
+
+    vector<ColumnComparison<T>> result;
+    if (below)
+        result.push_back({below->inclusive ? Comparison::LessOrEqual : Comparison::Less, below->value});
+    if (above)
+        result.push_back({above->inclusive ? Comparison::GreaterOrEqual : Comparison::Greater, above->value});
+    for (const T &value : points) {
+        result.push_back({Comparison::Equal, value});
+    }
+
+    return result;
+}
+
+shared_ptr<Node> SimplifyLogicalOperation(const LogicalOperationNode &node) {
+    const LogicalOperation operation = node.GetOperation();
+    const bool is_and = operation == LogicalOperation::And;
+
+    vector<ColumnComparison<Date>> dates;
+    vector<ColumnComparison<string>> events;
+    vector<shared_ptr<Node>> event_nodes;
+    vector<shared_ptr<Node>> others;
+
+    // operands of a simplified child with the same operation are already simplified,
+    // so they are merged into this node as they are
+    vector<shared_ptr<Node>> operands;
+    for (const auto &operand : node.GetOperands()) {
+        const auto simplified = SimplifyCondition(operand);
+        const auto logical = dynamic_pointer_cast<LogicalOperationNode>(simplified);
+
+        if (logical && logical->GetOperation() == operation) {
+            operands.insert(operands.end(), logical->GetOperands().begin(), logical->GetOperands().end());
+        } else {
+            operands.push_back(simplified);
+        }
+    }
+
+    for (const auto &operand : operands) {
+        if (dynamic_pointer_cast<FalseNode>(operand)) {
+            if (is_and)
+                return operand;
+        } else if (dynamic_pointer_cast<EmptyNode>(operand)) {
+            if (!is_and)
+                return operand;
+        } else if (const auto date = dynamic_pointer_cast<DateComparisonNode>(operand)) {
+            dates.push_back({date->GetComparison(), date->GetDate()});
+        } else if (const auto event = dynamic_pointer_cast<EventComparisonNode>(operand)) {
+            events.push_back({event->GetComparison(), event->GetEvent()});
+            event_nodes.push_back(operand);
+        } else {
+            others.push_back(operand);
+        }
+    }
+
+    vector<shared_ptr<Node>> result;
+
+    const auto merged_dates = is_and ? MergeAnd(dates) : MergeOr(dates);
+    if (!merged_dates) {
+        if (is_and)
+            return make_shared<FalseNode>();
+        return make_shared<EmptyNode>();
+    }
+    for (const auto &comparison : *merged_dates) {
+        result.push_back(make_shared<DateComparisonNode>(comparison.comparison, comparison.value));
+    }
+
+    // every event comparison holds for the signal pill, so contradicting event
+    // comparisons are not constant false and are kept as they are
+    const auto merged_events = is_and ? MergeAnd(events) : MergeOr(events);
+    if (!merged_events) {
+        if (!is_and)
+            return make_shared<EmptyNode>();
+        result.insert(result.end(), event_nodes.begin(), event_nodes.end());
+    } else {
+        for (const auto &comparison : *merged_events) {
+            result.push_back(make_shared<EventComparisonNode>(comparison.comparison, comparison.value));
+        }
+    }
+
+    result.insert(result.end(), others.begin(), others.end());
+
+    if (result.empty()) {
+        if (is_and)
+            return make_shared<EmptyNode>();
+        return make_shared<FalseNode>();
+    }
+    if (result.size() == 1)
+        return result.front();
+
+    return make_shared<LogicalOperationNode>(operation, move(result));
+}
+
+}
+
+shared_ptr<Node> SimplifyCondition(const shared_ptr<Node> &condition) {
+    if (const auto logical = dynamic_pointer_cast<LogicalOperationNode>(condition))
+        return SimplifyLogicalOperation(*logical);
+
+    return condition;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "node.h"
+
+#include <memory>
+
+// Rewrites a condition into an equivalent one which is cheaper to evaluate:
+// nested AND/OR are flattened, comparisons of the same column are merged into
+// intervals, contradictions become FalseNode and tautologies become EmptyNode
+shared_ptr<Node> SimplifyCondition(const shared_ptr<Node> &condition);
@@ -1,27 +1,1139 @@
 #include <iostream>
 #include <sstream>
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include <unistd.h>
 #include "database.h"
+#include "memory_usage.h"
+
+namespace {
+
+// Buffered Adds are merged once there are this many of them or their events take this many bytes
+const size_t WRITE_BUFFER_SIZE = 4096;
+const size_t WRITE_BUFFER_BYTES = 1 << 20;
+
+}
 
 void Database::Add(const Date &date, const std::string &event) {
     if (event.empty())
         return;
 
-    auto it = storage[date].insert(event);
+    Flush();
+
+    auto bucket = history.end();
+    Insert(bucket, date, event);
+    FinishInserts();
+}
+
+void Database::AddBuffered(const Date &date, const std::string &event) {
+    if (event.empty())
+        return;
+
+    write_buffer_events.append(event);
+    write_buffer.emplace_back(date, write_buffer_events.size());
+
+    if (write_buffer.size() == WRITE_BUFFER_SIZE || write_buffer_events.size() >= WRITE_BUFFER_BYTES)
+        Flush();
+}
+
+bool Database::HasBufferedAdds() const {
+    return !write_buffer.empty();
+}
+
+void Database::Flush() {
+    if (write_buffer.empty())
+        return;
+
+    // a stable order by date visits every bucket once and keeps the order of its events
+    std::vector<uint32_t> order(write_buffer.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](uint32_t lhs, uint32_t rhs) {
+        return write_buffer[lhs].first < write_buffer[rhs].first;
+    });
+
+    auto bucket = history.end();
+    for (uint32_t i : order) {
+        const size_t begin = i == 0 ? 0 : write_buffer[i - 1].second;
+        Insert(bucket, write_buffer[i].first,
+               std::string_view(write_buffer_events.data() + begin, write_buffer[i].second - begin));
+    }
+
+    std::string().swap(write_buffer_events);
+    std::vector<std::pair<Date, size_t>>().swap(write_buffer);
+
+    FinishInserts();
+}
+
+void Database::Insert(std::map<Date, EventBucket>::iterator &bucket, const Date &date, std::string_view event) {
+    if (bucket == history.end() || bucket->first != date) {
+        bool created;
+        std::tie(bucket, created) = history.try_emplace(date);
+        if (created) {
+            memory.date_nodes += TreeNodeBytes<std::pair<const Date, EventBucket>>();
+            memory.buckets += bucket->second.MemoryUsage();
+            RecordCreation(current_version - 1, date);
+        }
+    }
+
+    RecordChange(current_version - 1, bucket);
+    PrepareWrite(bucket);
+
+    const BucketMemoryUsage before = bucket->second.MemoryUsage();
+    const bool inserted = bucket->second.Insert(event);
+    TrackBucket(before, bucket->second);
+
+    if (inserted) {
+        statistics.Add(date, event);
+        subscriptions.Publish(true, date, event);
+    }
+}
+
+void Database::FinishInserts() {
+    // adds only move the newest date forward, so expiring once after all of them
+    // removes the same entries as expiring after each one
+    if (retention.automatic) {
+        RemoveExpired();
+    }
+
+    RefreshViews();
+    EnforceMemoryBudget();
+}
+
+void Database::SetRetentionPolicy(const RetentionPolicy &policy) {
+    Flush();
+    retention = policy;
+}
+
+namespace {
+
+// Idle buckets are looked for once per this many writes
+const uint64_t COMPRESSION_PERIOD = 1024;
+
+}
+
+void Database::SetCompression(std::optional<uint64_t> idle_writes) {
+    Flush();
+    compression_idle_writes = idle_writes;
+    last_writes.clear();
+
+    for (auto it = history.begin(); it != history.end(); ++it) {
+        if (it->second.IsSpilled())
+            continue;
+
+        const BucketMemoryUsage before = it->second.MemoryUsage();
+        it->second.Inflate();
+        TrackBucket(before, it->second);
+
+        // buckets get the whole idle period from now on before they are compressed
+        if (compression_idle_writes)
+            last_writes.emplace_hint(last_writes.end(), it->first, write_clock);
+    }
+}
+
+void Database::PrepareWrite(std::map<Date, EventBucket>::iterator bucket) {
+    // the sweep goes first, as it may compress this very bucket
+    if (compression_idle_writes && ++write_clock % COMPRESSION_PERIOD == 0)
+        CompressIdleBuckets();
+
+    if (bucket->second.IsSpilled())
+        PageIn(bucket);
+
+    if (bucket->second.IsCompressed()) {
+        const BucketMemoryUsage before = bucket->second.MemoryUsage();
+        bucket->second.Inflate();
+        TrackBucket(before, bucket->second);
+    }
+
+    if (compression_idle_writes)
+        last_writes[bucket->first] = write_clock;
+}
+
+void Database::CompressIdleBuckets() {
+    for (auto it = last_writes.begin(); it != last_writes.end();) {
+        if (it->second + *compression_idle_writes > write_clock) {
+            ++it;
+            continue;
+        }
+
+        auto bucket = history.find(it->first);
+        if (bucket != history.end()) {
+            const BucketMemoryUsage before = bucket->second.MemoryUsage();
+            bucket->second.Compress();
+            TrackBucket(before, bucket->second);
+        }
+        it = last_writes.erase(it);
+    }
+}
+
+namespace {
+
+// Spilling goes on until memory usage falls to this share of the budget,
+// so that the writes which follow do not spill a bucket at a time
+const size_t SPILL_TARGET_PERCENT = 75;
+
+// Segment files of all databases of the process get distinct names
+std::atomic<uint64_t> next_segment_id{0};
+
+}
+
+void Database::SetMemoryBudget(std::optional<size_t> budget, const std::string &directory) {
+    Flush();
+    memory_budget = budget;
+    spill_directory = directory;
+
+    if (memory_budget) {
+        EnforceMemoryBudget();
+        return;
+    }
+
+    for (auto it = history.begin(); it != history.end(); ++it) {
+        if (!it->second.IsSpilled())
+            continue;
+
+        PageIn(it);
+        if (!compression_idle_writes) {
+            const BucketMemoryUsage before = it->second.MemoryUsage();
+            it->second.Inflate();
+            TrackBucket(before, it->second);
+        }
+    }
+}
+
+std::map<Date, std::unique_ptr<Segment>>::const_iterator Database::FindSegment(const Date &date) const {
+    // ranges of segments do not overlap, so the last one starting before the date is the one
+    return std::prev(segments.upper_bound(date));
+}
+
+void Database::DropFromSegment(const Date &date) {
+    const auto segment = FindSegment(date);
+    segment->second->Drop(date);
+    if (segment->second->Empty()) {
+        memory.segments -= segment->second->MemoryUsage();
+        segments.erase(segment);
+    }
+}
+
+void Database::PageIn(std::map<Date, EventBucket>::iterator bucket) {
+    const BucketMemoryUsage before = bucket->second.MemoryUsage();
+    bucket->second = EventBucket::FromPacked(FindSegment(bucket->first)->second->Read(bucket->first),
+                                             bucket->second.Size());
+    TrackBucket(before, bucket->second);
+
+    DropFromSegment(bucket->first);
+}
+
+void Database::EnforceMemoryBudget() {
+    if (!memory_budget || history.empty() || MemoryUsage().Total() <= *memory_budget)
+        return;
+
+    const size_t target = *memory_budget / 100 * SPILL_TARGET_PERCENT;
+    size_t total = MemoryUsage().Total();
+
+    // the newest bucket is where writes go, so it always stays in memory
+    std::vector<std::pair<Date, std::string>> spilled;
+    for (auto it = history.begin(); total > target && std::next(it) != history.end(); ++it) {
+        if (it->second.IsSpilled())
+            continue;
+
+        spilled.emplace_back(it->first, it->second.Pack());
+        total -= std::min(total, it->second.MemoryUsage().Total());
+    }
+
+    if (spilled.empty())
+        return;
+
+    std::vector<Date> dates;
+    for (const auto &item : spilled) {
+        dates.push_back(item.first);
+    }
+
+    // buckets are freed only after the segment has been written
+    WriteSegment(std::move(spilled));
 
-    if (it.second) {
-        history[date].push_back(event);
+    for (const Date &date : dates) {
+        auto it = history.find(date);
+        const BucketMemoryUsage before = it->second.MemoryUsage();
+        it->second.Spill();
+        TrackBucket(before, it->second);
+        last_writes.erase(date);
     }
 }
 
+void Database::WriteSegment(std::vector<std::pair<Date, std::string>> buckets) {
+    // segments which overlap the dates of the buckets
+    auto first = segments.upper_bound(buckets.front().first);
+    if (first != segments.begin() && std::prev(first)->second->Last() >= buckets.front().first)
+        --first;
+    auto last = segments.upper_bound(buckets.back().first);
+
+    size_t size = buckets.size();
+    for (auto it = first; it != last; ++it) {
+        size += it->second->Size();
+    }
+
+    // neighbours which are not larger are merged as well, so a bucket is rewritten
+    // a logarithmic number of times and the number of segments stays logarithmic too
+    while (first != segments.begin() && std::prev(first)->second->Size() <= size) {
+        --first;
+        size += first->second->Size();
+    }
+    while (last != segments.end() && last->second->Size() <= size) {
+        size += last->second->Size();
+        ++last;
+    }
+
+    for (auto it = first; it != last; ++it) {
+        it->second->ReadAll(buckets);
+    }
+    std::sort(buckets.begin(), buckets.end(), [](const auto &lhs, const auto &rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    const std::string path = spill_directory + "/segment-" + std::to_string(getpid())
+                             + "-" + std::to_string(next_segment_id++) + ".seg";
+    auto segment = std::make_unique<Segment>(path, buckets);
+
+    // the merged segments are removed only after their buckets have been written again
+    for (auto it = first; it != last;) {
+        memory.segments -= it->second->MemoryUsage();
+        it = segments.erase(it);
+    }
+
+    memory.segments += segment->MemoryUsage();
+    const Date start = segment->First();
+    segments.emplace(start, std::move(segment));
+}
+
+int Database::Expire() {
+    Flush();
+    StartVersion();
+
+    const int removed = RemoveExpired();
+    RefreshViews();
+    return removed;
+}
+
+int Database::RemoveExpired() {
+    if (history.empty())
+        return 0;
+
+    std::optional<Date> border = retention.floor;
+
+    if (retention.max_age_days) {
+        const int64_t newest = DateToDays(std::prev(history.end())->first);
+        const Date oldest = DaysToDate(newest - *retention.max_age_days);
+
+        if (!border || *border < oldest)
+            border = oldest;
+    }
+
+    if (!border)
+        return 0;
+
+    return RemoveBefore(*border);
+}
+
+int Database::RemoveBefore(const Date &date) {
+    const auto history_border = history.lower_bound(date);
+
+    int removed = 0;
+    for (auto it = history.begin(); it != history_border;) {
+        removed += it->second.Size();
+        ForgetBucket(*it);
+        it = EraseBucket(it);
+    }
+
+    return removed;
+}
+
+namespace {
+
+// Rows are collected here and written out in chunks of this size
+const size_t PRINT_BUFFER_SIZE = 1 << 16;
+
+}
+
 void Database::Print(std::ostream &os) const {
+    std::string buffer;
+    buffer.reserve(PRINT_BUFFER_SIZE);
+
+    EventBucket scratch;
+
     for (const auto &item : history) {
 
-        if (item.second.empty()) continue;
+        if (item.second.Empty()) continue;
+
+        // date is formatted once per bucket, years beyond four digits go through the stream
+        char date_buffer[DATE_FORMAT_LENGTH];
+        std::string long_date;
+        std::string_view date(date_buffer, DATE_FORMAT_LENGTH);
+
+        if (!FormatDate(item.first, date_buffer)) {
+            std::ostringstream date_stream;
+            date_stream << item.first;
+            long_date = date_stream.str();
+            date = long_date;
+        }
+
+        for (std::string_view event : Readable(item, scratch)) {
+            buffer.append(date);
+            buffer.push_back(' ');
+            buffer.append(event);
+            buffer.push_back('\n');
+
+            if (buffer.size() >= PRINT_BUFFER_SIZE) {
+                os.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+    }
+
+    os.write(buffer.data(), buffer.size());
+    os.flush();
+}
+
+namespace {
+
+// Buckets of the map which fall into the date range
+template<typename Map>
+auto SeekRange(Map &map, const DateRange &range) -> std::pair<decltype(map.begin()), decltype(map.begin())> {
+    if (range.IsEmpty())
+        return {map.end(), map.end()};
+
+    auto begin = map.begin();
+    if (range.from)
+        begin = range.from->inclusive ? map.lower_bound(range.from->date) : map.upper_bound(range.from->date);
+
+    auto end = map.end();
+    if (range.to)
+        end = range.to->inclusive ? map.upper_bound(range.to->date) : map.lower_bound(range.to->date);
+
+    return {begin, end};
+}
+
+// Last event of the bucket matching the condition, found walking from the newest event
+std::optional<std::string_view> LastMatch(const Date &date, const EventBucket &events, const Node &condition) {
+    if (!condition.DependsOnEvent()) {
+        if (events.Empty() || !condition.Evaluate(date, ""))
+            return std::nullopt;
+        return events.Back();
+    }
+
+    for (size_t i = events.Size(); i-- > 0;) {
+        if (condition.Evaluate(date, events.At(i)))
+            return events.At(i);
+    }
+    return std::nullopt;
+}
+
+// Dates left to a query which resumes from the cursor, the date of the cursor included
+DateRange CursorRange(const FindOptions &options) {
+    DateRange range;
+    if (!options.after)
+        return range;
+
+    (options.descending ? range.to : range.from) = DateBound{options.after->date, true};
+    return range;
+}
+
+// Clears the bits of mask for the events of the bucket of the cursor date which the query has passed,
+// the ones up to the event of the cursor in the order of the query
+void TrimToCursor(const EventBucket &events, const FindOptions &options, EventMask &mask) {
+    const std::string_view cursor = options.after->event;
+    for (size_t i = 0; i < events.Size(); ++i) {
+        if (options.descending ? events.At(i) >= cursor : events.At(i) <= cursor)
+            mask[i / 64] &= ~(uint64_t(1) << (i % 64));
+    }
+}
+
+// Rows of a Find with options, gathered bucket by bucket in the order of the query
+class RowCollector {
+public:
+    explicit RowCollector(const FindOptions &options) : skip(options.offset), limit(options.limit),
+                                                        descending(options.descending),
+                                                        by_event(options.limit || options.after) {
+    }
+
+    // True once the limit is reached, the scan stops then
+    bool Done() const {
+        return limit && result.entries.size() >= *limit;
+    }
+
+    // Takes the events with their bit set in mask
+    void Collect(const Date &date, const EventBucket &events, const EventMask &mask) {
+        size_t matching = 0;
+        for (uint64_t word : mask) {
+            matching += __builtin_popcountll(word);
+        }
+
+        // buckets within the offset are skipped as a whole
+        if (skip >= matching) {
+            skip -= matching;
+            return;
+        }
+
+        if (by_event) {
+            CollectByEvent(date, events, mask);
+            return;
+        }
+
+        if (descending) {
+            for (size_t word = mask.size(); word-- > 0 && !Done();) {
+                for (uint64_t bits = mask[word]; bits && !Done();) {
+                    const int bit = 63 - __builtin_clzll(bits);
+                    Take(date, events, word * 64 + bit);
+                    bits &= ~(uint64_t(1) << bit);
+                }
+            }
+        } else {
+            for (size_t word = 0; word < mask.size() && !Done(); ++word) {
+                for (uint64_t bits = mask[word]; bits && !Done(); bits &= bits - 1) {
+                    Take(date, events, word * 64 + __builtin_ctzll(bits));
+                }
+            }
+        }
+    }
+
+    FindResult Result() {
+        return std::move(result);
+    }
+
+private:
+    // Sorts only as many of the rows as the offset and the limit still take
+    void CollectByEvent(const Date &date, const EventBucket &events, const EventMask &mask) {
+        rows.clear();
+        for (size_t word = 0; word < mask.size(); ++word) {
+            for (uint64_t bits = mask[word]; bits; bits &= bits - 1) {
+                rows.push_back(static_cast<uint32_t>(word * 64 + __builtin_ctzll(bits)));
+            }
+        }
+
+        const size_t taken = limit ? std::min(rows.size(), skip + *limit - result.entries.size()) : rows.size();
+        std::partial_sort(rows.begin(), rows.begin() + taken, rows.end(), [&](uint32_t lhs, uint32_t rhs) {
+            return descending ? events.At(rhs) < events.At(lhs) : events.At(lhs) < events.At(rhs);
+        });
+
+        for (size_t i = 0; i < taken; ++i) {
+            Take(date, events, rows[i]);
+        }
+    }
+
+    void Take(const Date &date, const EventBucket &events, size_t index) {
+        if (skip > 0) {
+            skip--;
+            return;
+        }
+
+        const std::string_view event = events.At(index);
+        result.entries.emplace_back(date, std::string(event));
+
+        // rows may be left only when the limit cut the scan short
+        if (Done())
+            result.cursor = FindCursor{date, std::string(event)};
+    }
+
+    size_t skip;
+    std::optional<size_t> limit;
+    bool descending;
+    bool by_event;
+    std::vector<uint32_t> rows;     // matching rows of the bucket being collected
+    FindResult result;
+};
+
+// Dates of the condition which are not after date
+DateRange RangeUpTo(const Date &date, const Node &condition) {
+    DateRange range;
+    range.to = DateBound{date, true};
+    return Intersect(condition.GetDateRange(), range);
+}
+
+}
+
+void Database::SetVersionLimit(size_t limit) {
+    Flush();
+    version_limit = limit;
+    TrimVersions();
+}
+
+uint64_t Database::GetVersion() const {
+    return current_version;
+}
+
+bool Database::HasVersion(uint64_t version) const {
+    return oldest_version <= version && version <= current_version;
+}
+
+void Database::StartVersion() {
+    current_version++;
+    version_changes.emplace_back();
+    TrimVersions();
+}
+
+void Database::TrimVersions() {
+    while (version_changes.size() > version_limit) {
+        for (const auto &change : version_changes.front()) {
+            memory.versions -= TreeNodeBytes<std::pair<const Date, std::optional<EventBucket>>>();
+            if (change.second)
+                memory.versions -= change.second->MemoryUsage().Total();
+        }
+
+        version_changes.pop_front();
+        oldest_version++;
+    }
+}
+
+void Database::RecordChange(uint64_t past_version, std::map<Date, EventBucket>::const_iterator bucket) {
+    if (past_version < oldest_version || past_version >= current_version)
+        return;
+
+    auto [change, created] = version_changes[past_version - oldest_version].try_emplace(bucket->first);
+    if (!created)
+        return;
+
+    const EventBucket &events = bucket->second;
+    change->second = EventBucket::FromPacked(
+            events.IsSpilled() ? FindSegment(bucket->first)->second->Read(bucket->first) : events.Pack(), events.Size());
+
+    memory.versions += TreeNodeBytes<std::pair<const Date, std::optional<EventBucket>>>()
+                       + change->second->MemoryUsage().Total();
+}
+
+void Database::RecordCreation(uint64_t past_version, const Date &date) {
+    if (past_version < oldest_version || past_version >= current_version)
+        return;
+
+    if (version_changes[past_version - oldest_version].try_emplace(date).second)
+        memory.versions += TreeNodeBytes<std::pair<const Date, std::optional<EventBucket>>>();
+}
+
+void Database::CheckVersion(uint64_t version) const {
+    if (!HasVersion(version))
+        throw std::out_of_range("Unknown version " + std::to_string(version));
+}
+
+void Database::VisitVersion(const DateRange &range, uint64_t version, bool descending,
+                            const std::function<bool(const Date &, const EventBucket *)> &visit) const {
+    CheckVersion(version);
+
+    // the rest of every map to walk, its next date is the first one or the last one when descending
+    const auto head = [descending](const auto &source) -> const auto & {
+        return descending ? *std::prev(source.second) : *source.first;
+    };
+    const auto advance = [descending](auto &source) {
+        if (descending)
+            --source.second;
+        else
+            ++source.first;
+    };
+
+    // from the changes of the version on, so that the first changes at or after it win
+    std::vector<decltype(SeekRange(version_changes.front(), range))> changes;
+    for (uint64_t past = version; past < current_version; ++past) {
+        changes.push_back(SeekRange(version_changes[past - oldest_version], range));
+    }
+    auto current = SeekRange(history, range);
+
+    while (true) {
+        std::optional<Date> date;
+        const auto consider = [&](const Date &next) {
+            if (!date || (descending ? *date < next : next < *date))
+                date = next;
+        };
+
+        if (current.first != current.second)
+            consider(head(current).first);
+        for (const auto &source : changes) {
+            if (source.first != source.second)
+                consider(head(source).first);
+        }
+
+        if (!date)
+            return;
+
+        std::optional<const EventBucket *> events;
+        for (auto &source : changes) {
+            if (source.first == source.second || head(source).first != *date)
+                continue;
+
+            if (!events) {
+                const auto &change = head(source).second;
+                events = change ? &*change : nullptr;
+            }
+            advance(source);
+        }
+
+        if (current.first != current.second && head(current).first == *date) {
+            if (!events)
+                events = &head(current).second;
+            advance(current);
+        }
+
+        if (!visit(*date, *events))
+            return;
+    }
+}
+
+std::vector<std::pair<Date, std::string>> Database::FindIf(const std::shared_ptr<Node> &condition,
+                                                           uint64_t version) const {
+    return FindIf(condition, version, FindOptions()).entries;
+}
+
+FindResult Database::FindIf(const std::shared_ptr<Node> &condition, uint64_t version,
+                            const FindOptions &options) const {
+    RowCollector collector(options);
+    EventBucket scratch;
+    EventMask mask;
+
+    VisitVersion(Intersect(condition->GetDateRange(), CursorRange(options)), version, options.descending,
+                 [&](const Date &date, const EventBucket *bucket) {
+        if (collector.Done())
+            return false;
+        if (!bucket)
+            return true;
+
+        const EventBucket &events = Readable(date, *bucket, scratch);
+        condition->EvaluateBucket(date, events, mask);
+        if (options.after && date == options.after->date)
+            TrimToCursor(events, options, mask);
+        collector.Collect(date, events, mask);
+        return true;
+    });
+
+    return collector.Result();
+}
+
+std::string Database::Last(const Date &date, const std::shared_ptr<Node> &condition, uint64_t version) const {
+    EventBucket scratch;
+    std::string last = "No entries";
+
+    VisitVersion(RangeUpTo(date, *condition), version, true, [&](const Date &bucket_date, const EventBucket *bucket) {
+        if (!bucket || bucket->Empty())
+            return true;
+
+        const auto event = LastMatch(bucket_date, Readable(bucket_date, *bucket, scratch), *condition);
+        if (!event)
+            return true;
+
+        std::stringstream os;
+        os << bucket_date << " " << *event;
+        last = os.str();
+        return false;
+    });
+
+    return last;
+}
+
+std::string Database::Last(const Date &date, uint64_t version) const {
+    DateRange range;
+    range.to = DateBound{date, true};
+    EventBucket scratch;
+    std::string last = "No entries";
 
-        for (const std::string &event : item.second) {
-            os << item.first << " " << event << std::endl;
+    VisitVersion(range, version, true, [&](const Date &bucket_date, const EventBucket *bucket) {
+        if (!bucket || bucket->Empty())
+            return true;
+
+        std::stringstream os;
+        os << bucket_date << " " << Readable(bucket_date, *bucket, scratch).Back();
+        last = os.str();
+        return false;
+    });
+
+    return last;
+}
+
+std::vector<std::pair<Date, std::string>> Database::FindIf(const std::shared_ptr<Node> &condition) const {
+    return FindIf(condition, FindOptions()).entries;
+}
+
+FindResult Database::FindIf(const std::shared_ptr<Node> &condition, const FindOptions &options) const {
+    RowCollector collector(options);
+    EventBucket scratch;
+    EventMask mask;
+
+    // a cursor turns the scan into a seek to its date
+    const auto range = SeekRange(history, Intersect(Plan(condition).range, CursorRange(options)));
+    const auto collect = [&](const std::pair<const Date, EventBucket> &item) {
+        const EventBucket &events = Readable(item, scratch);
+        condition->EvaluateBucket(item.first, events, mask);
+        if (options.after && item.first == options.after->date)
+            TrimToCursor(events, options, mask);
+        collector.Collect(item.first, events, mask);
+    };
+
+    if (options.descending) {
+        for (auto it = std::make_reverse_iterator(range.second);
+             it != std::make_reverse_iterator(range.first) && !collector.Done(); ++it) {
+            collect(*it);
+        }
+    } else {
+        for (auto it = range.first; it != range.second && !collector.Done(); ++it) {
+            collect(*it);
+        }
+    }
+
+    return collector.Result();
+}
+
+int Database::CountIf(const std::shared_ptr<Node> &condition) const {
+    return CountIf(condition, Plan(condition), nullptr);
+}
+
+int Database::CountIf(const std::shared_ptr<Node> &condition, const QueryPlan &plan,
+                      QueryExplanation *explanation) const {
+    int count = 0;
+    EventBucket scratch;
+    EventMask mask;
+
+    const auto range = SeekRange(history, plan.range);
+
+    for (auto it = range.first; it != range.second; ++it) {
+        if (explanation) {
+            explanation->buckets_touched++;
+            explanation->rows_touched += plan.date_only ? 0 : it->second.Size();
+        }
+
+        if (plan.date_only) {
+            if (condition->Evaluate(it->first, ""))
+                count += it->second.Size();
+            continue;
+        }
+
+        condition->EvaluateBucket(it->first, Readable(*it, scratch), mask);
+        for (uint64_t word : mask) {
+            count += __builtin_popcountll(word);
+        }
+    }
+
+    return count;
+}
+
+bool Database::ExistsIf(const std::shared_ptr<Node> &condition) const {
+    EventBucket scratch;
+    EventMask mask;
+
+    const QueryPlan plan = Plan(condition);
+    const auto range = SeekRange(history, plan.range);
+
+    for (auto it = range.first; it != range.second; ++it) {
+        if (plan.date_only) {
+            if (condition->Evaluate(it->first, ""))
+                return true;
+            continue;
         }
+
+        condition->EvaluateBucket(it->first, Readable(*it, scratch), mask);
+        if (!IsMaskEmpty(mask))
+            return true;
     }
+
+    return false;
+}
+
+uint64_t Database::Subscribe(const std::shared_ptr<Node> &condition) {
+    Flush();
+    return subscriptions.Subscribe(condition);
+}
+
+bool Database::Unsubscribe(uint64_t id) {
+    Flush();
+    return subscriptions.Unsubscribe(id);
+}
+
+std::optional<std::vector<SubscriptionDelta>> Database::TakeDeltas(uint64_t id) {
+    Flush();
+    return subscriptions.Take(id);
+}
+
+uint64_t Database::CreateView(const std::shared_ptr<Node> &condition) {
+    Flush();
+
+    ViewResult result;
+    std::map<Date, int> matching_dates;
+    EventBucket scratch;
+    EventMask mask;
+
+    const auto range = SeekRange(history, condition->GetDateRange());
+    for (auto it = range.first; it != range.second; ++it) {
+        const EventBucket &events = Readable(*it, scratch);
+        condition->EvaluateBucket(it->first, events, mask);
+
+        int matching = 0;
+        size_t last = 0;
+        for (size_t word = 0; word < mask.size(); ++word) {
+            if (mask[word] == 0)
+                continue;
+            matching += __builtin_popcountll(mask[word]);
+            last = word * 64 + 63 - __builtin_clzll(mask[word]);
+        }
+
+        if (matching == 0)
+            continue;
+
+        result.count += matching;
+        matching_dates.emplace_hint(matching_dates.end(), it->first, matching);
+        result.latest.emplace(it->first, std::string(events.At(last)));
+    }
+
+    return subscriptions.CreateView(condition, std::move(result), std::move(matching_dates));
+}
+
+bool Database::DropView(uint64_t id) {
+    Flush();
+    return subscriptions.DropView(id);
+}
+
+std::optional<ViewResult> Database::ReadView(uint64_t id) const {
+    const ViewResult *result = subscriptions.ReadView(id);
+    if (!result)
+        return std::nullopt;
+    return *result;
+}
+
+void Database::RefreshViews() {
+    subscriptions.RefreshViews([this](const Date &date, const Node &condition) -> std::optional<std::string> {
+        const auto bucket = history.find(date);
+        if (bucket == history.end())
+            return std::nullopt;
+
+        EventBucket scratch;
+        const auto event = LastMatch(date, Readable(*bucket, scratch), condition);
+        if (!event)
+            return std::nullopt;
+        return std::string(*event);
+    });
+}
+
+int Database::RemoveIf(const std::shared_ptr<Node> &condition) {
+    Flush();
+    StartVersion();
+
+    int deleted = 0;
+    EventBucket scratch;
+    EventMask mask;
+
+    const QueryPlan plan = Plan(condition);
+    const auto range = SeekRange(history, plan.range);
+
+    for (auto history_iter = range.first; history_iter != range.second;) {
+        const Date &date = history_iter->first;
+        EventBucket &history_events = history_iter->second;
+
+        // every event of the date gets the same answer, so the bucket goes away as a whole
+        if (plan.date_only) {
+            if (condition->Evaluate(date, "")) {
+                deleted += history_events.Size();
+                ForgetBucket(*history_iter);
+                history_iter = EraseBucket(history_iter);
+                continue;
+            }
+
+            history_iter++;
+            continue;
+        }
+
+        // compressed buckets are inflated only if something is to be removed from them
+        condition->EvaluateBucket(date, Readable(*history_iter, scratch), mask);
+
+        if (IsMaskEmpty(mask)) {
+            history_iter++;
+            continue;
+        }
+
+        RecordChange(current_version - 1, history_iter);
+        PrepareWrite(history_iter);
+        for (size_t word = 0; word < mask.size(); ++word) {
+            for (uint64_t bits = mask[word]; bits; bits &= bits - 1) {
+                const size_t index = word * 64 + __builtin_ctzll(bits);
+                ForgetEvent(date, history_events.At(index));
+            }
+        }
+
+        const BucketMemoryUsage before = history_events.MemoryUsage();
+        deleted += history_events.RemoveMasked(mask);
+        TrackBucket(before, history_events);
+
+        // if all events of the date have been deleted we clear the map record
+        if (history_events.Empty()) {
+            history_iter = EraseBucket(history_iter);
+            continue;
+        }
+
+        history_iter++;
+    }
+
+    RefreshViews();
+    EnforceMemoryBudget();
+    return deleted;
+}
+
+std::vector<BatchResult> Database::ExecuteBatch(const std::vector<BatchQuery> &queries) {
+    Flush();
+
+    // every Del starts its version as it would on its own, and keeps what it
+    // changes for the version before it
+    std::vector<uint64_t> past_versions(queries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        if (queries[i].remove) {
+            StartVersion();
+            past_versions[i] = current_version - 1;
+        }
+    }
+
+    std::vector<BatchResult> results(queries.size());
+    EventBucket scratch;
+    EventMask mask;
+
+    for (auto history_iter = history.begin(); history_iter != history.end();) {
+        const Date &date = history_iter->first;
+        EventBucket &history_events = history_iter->second;
+
+        // a compressed bucket is decoded once, and inflated by the first removal from it
+        const EventBucket *events = &Readable(*history_iter, scratch);
+
+        for (size_t i = 0; i < queries.size() && !history_events.Empty(); ++i) {
+            queries[i].condition->EvaluateBucket(date, *events, mask);
+
+            if (IsMaskEmpty(mask))
+                continue;
+
+            if (queries[i].remove) {
+                RecordChange(past_versions[i], history_iter);
+                PrepareWrite(history_iter);
+                events = &history_events;
+            }
+
+            for (size_t word = 0; word < mask.size(); ++word) {
+                for (uint64_t bits = mask[word]; bits; bits &= bits - 1) {
+                    const size_t index = word * 64 + __builtin_ctzll(bits);
+
+                    if (queries[i].remove)
+                        ForgetEvent(date, events->At(index));
+                    else
+                        results[i].entries.emplace_back(date, std::string(events->At(index)));
+                }
+            }
+
+            if (queries[i].remove) {
+                const BucketMemoryUsage before = history_events.MemoryUsage();
+                results[i].removed += history_events.RemoveMasked(mask);
+                TrackBucket(before, history_events);
+            }
+        }
+
+        if (history_events.Empty()) {
+            history_iter = EraseBucket(history_iter);
+            continue;
+        }
+
+        history_iter++;
+    }
+
+    RefreshViews();
+    EnforceMemoryBudget();
+    return results;
+}
+
+QueryPlan Database::Plan(const std::shared_ptr<Node> &condition) const {
+    QueryPlan plan;
+
+    const DateRange range = condition->GetDateRange();
+    const double total = statistics.GetEventCount();
+
+    plan.date_only = !condition->DependsOnEvent();
+
+    if (range.IsEmpty()) {
+        plan.path = AccessPath::Nothing;
+        plan.range = range;
+        return plan;
+    }
+
+    // seeking pays off only if some of the entries fall out of the range
+    const double in_range = statistics.EstimateRows(range);
+    if ((range.from || range.to) && in_range < total) {
+        plan.path = AccessPath::DateRangeSeek;
+        plan.range = range;
+        plan.estimated_touched = in_range;
+    } else {
+        plan.path = AccessPath::FullScan;
+        plan.estimated_touched = total;
+    }
+
+    plan.estimated_rows = std::min(plan.estimated_touched, total * condition->EstimateSelectivity(statistics));
+
+    return plan;
+}
+
+QueryExplanation Database::Explain(const std::shared_ptr<Node> &condition) const {
+    QueryExplanation explanation;
+    explanation.plan = Plan(condition);
+    explanation.rows_matched = CountIf(condition, explanation.plan, &explanation);
+    return explanation;
+}
+
+const Statistics &Database::GetStatistics() const {
+    return statistics;
+}
+
+void Database::ForgetEvent(const Date &date, std::string_view event) {
+    statistics.Remove(date, event);
+    subscriptions.Publish(false, date, event);
+}
+
+void Database::ForgetBucket(const std::pair<const Date, EventBucket> &bucket) {
+    statistics.RemoveBucket(bucket.first, bucket.second.Size());
+
+    // the events are read, from a segment for a spilled bucket, only for the subscriptions
+    if (subscriptions.Empty())
+        return;
+
+    EventBucket scratch;
+    for (std::string_view event : Readable(bucket, scratch)) {
+        subscriptions.Publish(false, bucket.first, event);
+    }
+}
+
+const EventBucket &Database::Readable(const std::pair<const Date, EventBucket> &bucket, EventBucket &scratch) const {
+    return Readable(bucket.first, bucket.second, scratch);
+}
+
+const EventBucket &Database::Readable(const Date &date, const EventBucket &bucket, EventBucket &scratch) const {
+    if (!bucket.IsSpilled())
+        return bucket.Readable(scratch);
+
+    EventBucket::Unpack(FindSegment(date)->second->Read(date), bucket.Size(), scratch);
+    return scratch;
+}
+
+void Database::TrackBucket(const BucketMemoryUsage &before, const EventBucket &events) {
+    memory.buckets -= before;
+    memory.buckets += events.MemoryUsage();
+}
+
+std::map<Date, EventBucket>::iterator Database::EraseBucket(std::map<Date, EventBucket>::iterator bucket) {
+    memory.buckets -= bucket->second.MemoryUsage();
+    memory.date_nodes -= TreeNodeBytes<std::pair<const Date, EventBucket>>();
+    last_writes.erase(bucket->first);
+
+    if (!bucket->second.Empty())
+        RecordChange(current_version - 1, bucket);
+
+    if (bucket->second.IsSpilled())
+        DropFromSegment(bucket->first);
+
+    return history.erase(bucket);
+}
+
+size_t MemoryReport::Total() const {
+    return date_nodes + buckets.Total() + segments + versions + subscriptions + statistics;
+}
+
+MemoryReport Database::MemoryUsage() const {
+    MemoryReport report = memory;
+    report.statistics = statistics.MemoryUsage();
+    report.subscriptions = subscriptions.MemoryUsage();
+    return report;
 }
 
 std::string Database::Last(const Date &date) const {
@@ -35,26 +1147,39 @@ std::string Database::Last(const Date &date) const {
 
     std::stringstream os;
 
-    os << result->first << " " << result-> second.back();
+    EventBucket scratch;
+    os << result->first << " " << Readable(*result, scratch).Back();
     return os.str();
 }
 
+std::string Database::Last(const Date &date, const std::shared_ptr<Node> &condition) const {
+    const auto range = SeekRange(history, RangeUpTo(date, *condition));
+    EventBucket scratch;
+
+    // buckets from the newest, so the first match is the answer
+    for (auto it = std::make_reverse_iterator(range.second); it != std::make_reverse_iterator(range.first); ++it) {
+        const auto event = LastMatch(it->first, Readable(*it, scratch), *condition);
+        if (event) {
+            std::stringstream os;
+            os << it->first << " " << *event;
+            return os.str();
+        }
+    }
+
+    return "No entries";
+}
+
 int Database::GetHistoryEventSize() const {
     int count = 0;
     for (auto &item : history) {
-        count += item.second.size();
+        count += item.second.Size();
     }
 
     return count;
 }
 
 int Database::GetStorageEventSize() const {
-    int count = 0;
-    for (auto &item : storage) {
-        count += item.second.size();
-    }
-
-    return count;
+    return GetHistoryEventSize();
 }
 
 int Database::GetHistorySize() const {
@@ -62,5 +1187,5 @@ int Database::GetHistorySize() const {
 }
 
 int Database::GetStorageSize() const {
-    return storage.size();
+    return GetHistorySize();
 }
@@ -1,98 +1,407 @@
 #pragma once
 
-#include <set>
 #include <map>
+#include <memory>
+#include <optional>
 #include <string>
 #include <algorithm>
+#include <deque>
+#include <functional>
 #include <vector>
 #include "date.h"
+#include "event_bucket.h"
+#include "node.h"
+#include "segment.h"
+#include "statistics.h"
+#include "subscriptions.h"
 
+// Find or Del condition of a batch executed in one pass over the data
+struct BatchQuery {
+    bool remove;
+    std::shared_ptr<Node> condition;
+};
+
+struct BatchResult {
+    std::vector<std::pair<Date, std::string>> entries;
+    int removed = 0;
+};
+
+// Last row of a page of Find results. Rows of a date are paged in the order of their
+// events, so its date and its event stay a place in that order once the row is removed.
+struct FindCursor {
+    Date date;
+    std::string event;
+};
+
+// Which of the matching rows a Find returns: the rows in ascending order, or all of it
+// reversed for descending, without the first offset ones and up to limit of the rest.
+// With a limit or a cursor the rows of a date are ordered by event, otherwise they keep
+// the order they were added in. With a cursor only the rows after it are considered.
+struct FindOptions {
+    size_t offset = 0;
+    std::optional<size_t> limit;
+    bool descending = false;
+    std::optional<FindCursor> after;
+};
+
+// Rows of a Find with options, and the cursor to continue from when the limit cut them short
+struct FindResult {
+    std::vector<std::pair<Date, std::string>> entries;
+    std::optional<FindCursor> cursor;
+};
+
+// Dates kept by Database::Expire: not older than max_age_days relative to the newest
+// date and not before floor. With automatic set Expire runs after every Add.
+struct RetentionPolicy {
+    std::optional<int> max_age_days;
+    std::optional<Date> floor;
+    bool automatic = false;
+};
+
+enum class AccessPath {
+    Nothing, FullScan, DateRangeSeek
+};
+
+// How a condition is executed, chosen by Database::Plan from the statistics
+struct QueryPlan {
+    AccessPath path = AccessPath::FullScan;
+    DateRange range;                // buckets to visit, unbounded for a full scan
+    bool date_only = false;         // condition is evaluated once per bucket
+    double estimated_rows = 0;      // entries expected to match
+    double estimated_touched = 0;   // entries expected in the visited buckets
+};
+
+// Plan of a condition together with what its execution actually did
+struct QueryExplanation {
+    QueryPlan plan;
+    int buckets_touched = 0;
+    int rows_touched = 0;
+    int rows_matched = 0;
+};
+
+// Heap bytes held by Database, maintained on every change so reading it is cheap.
+// Node sizes of standard containers are estimated from their usual layouts.
+struct MemoryReport {
+    size_t date_nodes = 0;          // nodes of the map from dates to buckets
+    BucketMemoryUsage buckets;      // event bytes, offsets, prefixes and dedup index
+    size_t segments = 0;            // directories of buckets spilled to disk
+    size_t versions = 0;            // buckets kept for past versions
+    size_t subscriptions = 0;       // subscribed conditions and their queued deltas
+    size_t statistics = 0;
+
+    size_t Total() const;
+};
+
+// Adds can be buffered in arrival order and merged into the dated buckets in bulk, once the
+// buffer fills up, by Flush or before any other write. Merging inserts the entries one by one,
+// so the state is the same as for adding them one by one. Reads are const and see the entries
+// merged so far, so any number of them may run concurrently as long as no write does.
 class Database {
 public:
+    // Adds the entry right away, after the buffered ones
     void Add(const Date &date, const std::string &event);
 
+    // Same as Add, but the entry is only appended to the write buffer
+    void AddBuffered(const Date &date, const std::string &event);
+
+    bool HasBufferedAdds() const;
+
+    // Merges the buffered Adds into the buckets
+    void Flush();
+
+    void SetRetentionPolicy(const RetentionPolicy &policy);
+
+    // Buckets which none of the last idle_writes writes touched are front-coded,
+    // reads decode them on the fly and a write inflates the bucket it touches.
+    // nullopt turns compression off and inflates all buckets.
+    void SetCompression(std::optional<uint64_t> idle_writes);
+
+    // When MemoryUsage exceeds budget bytes, the oldest buckets are spilled to a new
+    // segment file in directory. Queries read a spilled bucket from its segment only
+    // when their date range includes it, a write brings the bucket back to memory.
+    // Segments which would overlap or are small next to the new one are merged into it,
+    // so a spilled bucket is found by its date and few files stay open.
+    // nullopt brings all buckets back and removes the segment files.
+    void SetMemoryBudget(std::optional<size_t> budget, const std::string &directory);
+
+    // Every Del and Expire starts a new version, the state before it stays readable as
+    // the previous version. Up to limit past versions are kept; a past version holds
+    // compressed copies of the buckets changed after it and shares all the others.
+    void SetVersionLimit(size_t limit);
+
+    uint64_t GetVersion() const;
+
+    // True for the current version and the past versions which are kept
+    bool HasVersion(uint64_t version) const;
+
+    // Registers the condition for continuous matching: every entry added or removed from now on
+    // is checked against it alone, and a delta is queued if it matches. Removals of all kinds,
+    // expiry included, are published, an Add of an entry which is already there is not.
+    uint64_t Subscribe(const std::shared_ptr<Node> &condition);
+
+    // False for an unknown subscription
+    bool Unsubscribe(uint64_t id);
+
+    // Deltas queued for the subscription since the last call, nullopt for an unknown subscription
+    std::optional<std::vector<SubscriptionDelta>> TakeDeltas(uint64_t id);
+
+    // Materialized view of the condition. Its count and latest matching entry are kept up to date
+    // by every change, which evaluates only the views it could match as for subscriptions,
+    // so reading a view does not look at the entries.
+    uint64_t CreateView(const std::shared_ptr<Node> &condition);
+
+    // False for an unknown view
+    bool DropView(uint64_t id);
+
+    // nullopt for an unknown view
+    std::optional<ViewResult> ReadView(uint64_t id) const;
+
+    // Drops all dates which fall out of the retention policy, returns the number of removed entries.
+    // Expired dates always form a prefix of the maps, so they are cut off by a range erase.
+    int Expire();
+
     void Print(std::ostream &os) const;
 
     std::string Last(const Date &date) const;
 
+    // Same as Last, but against the state as of a kept version, out_of_range is thrown for any other
+    std::string Last(const Date &date, uint64_t version) const;
+
+    // Last entry on or before date which matches the condition. Buckets are visited from
+    // the newest one within the date range of the condition and their events from the
+    // last added, so the scan stops at the first match.
+    std::string Last(const Date &date, const std::shared_ptr<Node> &condition) const;
+
+    // Same as Last with condition, but against the state as of a kept version, out_of_range is thrown for any other
+    std::string Last(const Date &date, const std::shared_ptr<Node> &condition, uint64_t version) const;
+
     template<typename Predicate>
     std::vector<std::pair<Date, std::string>> FindIf(Predicate predicate) const {
         std::vector<std::pair<Date, std::string>> result;
+        EventBucket scratch;
 
         for (const auto &item : history) {
 
             const Date &date = item.first;
 
             // Here we iterate through history to maintain order in which elements were added
-            for (const std::string &event : history.at(date)) {
+            for (std::string_view event : Readable(item, scratch)) {
                 if (predicate(date, event))
-                    result.emplace_back(date, event);
+                    result.emplace_back(date, std::string(event));
             }
         }
 
         return result;
     };
 
+    // Same as FindIf with predicate, but the condition is evaluated for whole buckets at once
+    // into a bitmask and only the rows with their bit set are materialized
+    std::vector<std::pair<Date, std::string>> FindIf(const std::shared_ptr<Node> &condition) const;
+
+    // Same as FindIf with condition, but against the state as of a kept version, out_of_range is thrown for any other
+    std::vector<std::pair<Date, std::string>> FindIf(const std::shared_ptr<Node> &condition, uint64_t version) const;
+
+    // Same as FindIf with condition, but only the rows chosen by options are returned. Descending
+    // queries walk the buckets from the newest one, and the scan stops once limit rows are found.
+    // Rows which are skipped by the offset are counted per bucket, not materialized.
+    //
+    // A cursor resumes the scan with a seek to its date, so a page costs the rows it returns
+    // and the bucket of its date. Within that bucket the scan goes on from the first event
+    // after the one of the cursor, which does not depend on the row still being there, so
+    // no row is skipped however many rows of the date were removed. Rows added after the
+    // cursor are returned by the following pages unless they sort before it.
+    FindResult FindIf(const std::shared_ptr<Node> &condition, const FindOptions &options) const;
+
+    // Same as FindIf with options, but against the state as of a kept version, out_of_range is thrown for any other
+    FindResult FindIf(const std::shared_ptr<Node> &condition, uint64_t version, const FindOptions &options) const;
+
+    // Number of entries matching the condition, nothing is materialized.
+    // Buckets are counted wholesale when the condition depends on date only.
+    int CountIf(const std::shared_ptr<Node> &condition) const;
+
+    // Stops at the first entry matching the condition
+    bool ExistsIf(const std::shared_ptr<Node> &condition) const;
+
     template<typename Predicate>
     int RemoveIf(Predicate predicate) {
+        Flush();
+        StartVersion();
+
         int deleted = 0;
+        EventBucket scratch;
+        EventMask mask;
 
-        // Iterating through map<Date, set<string>> - unique storage
-        for (auto storage_iter = storage.begin(); storage_iter != storage.end();) {
+        for (auto history_iter = history.begin(); history_iter != history.end();) {
 
-            const Date &date = storage_iter->first;
+            const Date &date = history_iter->first;
+            EventBucket &history_events = history_iter->second;
 
-            std::set<std::string> &storage_events = storage_iter->second;
-            std::vector<std::string> &history_events = history.at(date);
+            // compressed buckets are inflated only if something is to be removed from them
+            const EventBucket &events = Readable(*history_iter, scratch);
+            mask.assign((events.Size() + 63) / 64, 0);
+            for (size_t i = 0; i < events.Size(); ++i) {
+                if (predicate(date, events.At(i)))
+                    mask[i / 64] |= uint64_t(1) << (i % 64);
+            }
 
-            for (auto storage_events_iter = storage_events.begin(); storage_events_iter != storage_events.end();) {
+            if (IsMaskEmpty(mask)) {
+                history_iter++;
+                continue;
+            }
 
-                if (!predicate(date, *storage_events_iter)) {
-                    storage_events_iter++;
-                    continue;
+            RecordChange(current_version - 1, history_iter);
+            PrepareWrite(history_iter);
+            for (size_t word = 0; word < mask.size(); ++word) {
+                for (uint64_t bits = mask[word]; bits; bits &= bits - 1) {
+                    ForgetEvent(date, history_events.At(word * 64 + __builtin_ctzll(bits)));
                 }
-
-                storage_events_iter = storage_events.erase(storage_events_iter);
-                deleted++;
             }
 
-            // remove if for vector which stores history of operations
-            auto history_border = std::stable_partition(
-                    history_events.begin(),
-                    history_events.end(),
-                    [predicate, date](const std::string &event) {
-                        return !predicate(date, event);
-                    }
-            );
-
-            history_events.erase(history_border, history_events.end());
+            const BucketMemoryUsage before = history_events.MemoryUsage();
+            deleted += history_events.RemoveMasked(mask);
+            TrackBucket(before, history_events);
 
-            //if all elements within vector have been deleted we clear map record
-            if (history_events.empty()) {
-                history.erase(date);
-            }
-
-            // same goes for set
-            if (storage_events.empty()) {
-                storage_iter = storage.erase(storage_iter);
+            //if all elements within bucket have been deleted we clear map record
+            if (history_events.Empty()) {
+                history_iter = EraseBucket(history_iter);
                 continue;
             }
 
-            storage_iter++;
+            history_iter++;
         }
 
+        RefreshViews();
+        EnforceMemoryBudget();
         return deleted;
     };
 
+    // Same as RemoveIf with predicate, but the condition is evaluated for whole buckets at once
+    int RemoveIf(const std::shared_ptr<Node> &condition);
+
+    // Runs all queries in a single traversal of the buckets. Every bucket is passed
+    // through the queries in their order, so results are the same as for running
+    // them one by one, including removals seen by the following queries.
+    std::vector<BatchResult> ExecuteBatch(const std::vector<BatchQuery> &queries);
+
+    // Chooses between a full scan and a seek to the dates the condition can match
+    QueryPlan Plan(const std::shared_ptr<Node> &condition) const;
+
+    // Plans and executes the condition as CountIf does, recording the work done
+    QueryExplanation Explain(const std::shared_ptr<Node> &condition) const;
+
+    const Statistics &GetStatistics() const;
+
+    MemoryReport MemoryUsage() const;
+
     int GetHistoryEventSize() const;
 
     int GetHistorySize() const;
 
+    // Buckets deduplicate events themselves, so storage sizes are the same as history sizes
     int GetStorageEventSize() const;
 
     int GetStorageSize() const;
 
 private:
-    std::map<Date, std::set<std::string>> storage;
-    std::map<Date, std::vector<std::string>> history;
+    // Inserts the event into the bucket of the date, bucket is reused if it is the one and set to it
+    void Insert(std::map<Date, EventBucket>::iterator &bucket, const Date &date, std::string_view event);
+
+    // Automatic retention, views and the memory budget, once after a run of inserts
+    void FinishInserts();
+
+    // Same as Expire without flushing, starting a version or refreshing views
+    int RemoveExpired();
+
+    // Removes whole buckets of dates before date
+    int RemoveBefore(const Date &date);
+
+    int CountIf(const std::shared_ptr<Node> &condition, const QueryPlan &plan,
+                QueryExplanation *explanation) const;
+
+    // Finds the latest entries of views which lost theirs, once a change is complete
+    void RefreshViews();
+
+    // Removes the event from statistics and publishes its removal to subscriptions
+    void ForgetEvent(const Date &date, std::string_view event);
+
+    // Same for all events of the bucket. Statistics drop the bucket by its size,
+    // so its events are read only if there are subscriptions to publish them to.
+    void ForgetBucket(const std::pair<const Date, EventBucket> &bucket);
+
+    // The events of the bucket, decoded into scratch if it is compressed or spilled
+    const EventBucket &Readable(const std::pair<const Date, EventBucket> &bucket, EventBucket &scratch) const;
+
+    const EventBucket &Readable(const Date &date, const EventBucket &bucket, EventBucket &scratch) const;
+
+    // Accounts for the change of bucket memory since before was taken
+    void TrackBucket(const BucketMemoryUsage &before, const EventBucket &events);
+
+    std::map<Date, EventBucket>::iterator EraseBucket(std::map<Date, EventBucket>::iterator bucket);
+
+    // Inflates the bucket if it is compressed or spilled and counts the write for compression
+    void PrepareWrite(std::map<Date, EventBucket>::iterator bucket);
+
+    // Compresses buckets which were not written by the last compression_idle_writes writes
+    void CompressIdleBuckets();
+
+    // Segment which has the spilled bucket of the date
+    std::map<Date, std::unique_ptr<Segment>>::const_iterator FindSegment(const Date &date) const;
+
+    // Drops the spilled bucket of the date from its segment, and the segment once it is empty
+    void DropFromSegment(const Date &date);
+
+    // Writes the packed buckets, which must not be spilled yet, to a new segment together
+    // with the buckets of the segments it would overlap and of its neighbours no larger than it
+    void WriteSegment(std::vector<std::pair<Date, std::string>> buckets);
+
+    // Loads a spilled bucket from its segment as a compressed one
+    void PageIn(std::map<Date, EventBucket>::iterator bucket);
+
+    // Spills the oldest buckets while memory usage is above the budget
+    void EnforceMemoryBudget();
+
+    // Closes the current version, the following changes keep what they overwrite for it
+    void StartVersion();
+
+    // Drops the oldest past versions beyond the limit
+    void TrimVersions();
+
+    // Keeps the bucket as it is for the past version, unless it changed since that version before
+    void RecordChange(uint64_t past_version, std::map<Date, EventBucket>::const_iterator bucket);
+
+    // Same for a date which has no bucket yet
+    void RecordCreation(uint64_t past_version, const Date &date);
+
+    // Throws out_of_range for a version which is not kept
+    void CheckVersion(uint64_t version) const;
+
+    // Calls visit with the buckets of the dates in range as of the version, nullptr for dates
+    // without entries then, until it returns false. Walks history and the changes after the
+    // version together, so nothing is gathered up front.
+    void VisitVersion(const DateRange &range, uint64_t version, bool descending,
+                      const std::function<bool(const Date &, const EventBucket *)> &visit) const;
+
+    RetentionPolicy retention;
+    std::optional<uint64_t> compression_idle_writes;
+    uint64_t write_clock = 0;
+    std::map<Date, uint64_t> last_writes;   // uncompressed buckets by their last write
+    std::optional<size_t> memory_budget;
+    std::string spill_directory;
+    std::map<Date, std::unique_ptr<Segment>> segments;    // by their first date, ranges do not overlap
+
+    // Buckets as they were at the end of each kept past version, starting with
+    // oldest_version, for the dates which changed after it. nullopt stands for a date
+    // which had no bucket. Past version v of a date is in the first changes at or after v.
+    std::deque<std::map<Date, std::optional<EventBucket>>> version_changes;
+    size_t version_limit = 0;
+    uint64_t current_version = 0;
+    uint64_t oldest_version = 0;
+
+    // events of buffered Adds back-to-back, with the date and the end of every event
+    std::string write_buffer_events;
+    std::vector<std::pair<Date, size_t>> write_buffer;
+    MemoryReport memory;
+    Statistics statistics;
+    SubscriptionIndex subscriptions;
+    std::map<Date, EventBucket> history;
 };
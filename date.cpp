@@ -1,3 +1,4 @@
+#include <charconv>
 #include <iostream>
 #include <iomanip>
 #include <stdexcept>
@@ -75,6 +76,25 @@ std::ostream &operator<<(std::ostream &stream, const Date &date) {
     return stream;
 }
 
+bool FormatDate(const Date &date, char *buffer) {
+    int year = date.GetYear();
+    if (year < 0 || year > 9999) {
+        return false;
+    }
+
+    for (int i = 3; i >= 0; --i, year /= 10) {
+        buffer[i] = static_cast<char>('0' + year % 10);
+    }
+    buffer[4] = '-';
+    buffer[5] = static_cast<char>('0' + date.GetMonth() / 10);
+    buffer[6] = static_cast<char>('0' + date.GetMonth() % 10);
+    buffer[7] = '-';
+    buffer[8] = static_cast<char>('0' + date.GetDay() / 10);
+    buffer[9] = static_cast<char>('0' + date.GetDay() % 10);
+
+    return true;
+}
+
 std::ostream &operator<<(std::ostream &stream,
                          const std::pair<Date, std::set<std::string>> &events) {
     for (auto &event : events.second) {
@@ -105,3 +125,82 @@ Date ParseDate(std::istream &date_stream) {
     }
     return Date(year, month, day);
 }
+
+namespace {
+
+bool IsSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Reads an int as istream >> int does: whitespace and a sign may come first,
+// returns nullptr if there is no number or it does not fit
+const char *ParseNumber(const char *begin, const char *end, int &value) {
+    while (begin != end && IsSpace(*begin)) {
+        ++begin;
+    }
+
+    const char *digits = begin;
+    if (digits != end && (*digits == '+' || *digits == '-'))
+        ++digits;
+    if (digits == end || *digits < '0' || *digits > '9')
+        return nullptr;
+
+    // from_chars takes a minus sign only
+    if (*begin == '+')
+        begin = digits;
+
+    const auto result = std::from_chars(begin, end, value);
+    return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+}
+
+DateParseResult ParseDate(const char *begin, const char *end, std::optional<Date> &date) {
+    int year;
+    const char *ptr = ParseNumber(begin, end, year);
+    if (!ptr || ptr == end || *ptr != '-')
+        return {begin, DateError::Format};
+
+    int month;
+    ptr = ParseNumber(ptr + 1, end, month);
+    if (!ptr || ptr == end || *ptr != '-')
+        return {begin, DateError::Format};
+
+    int day;
+    ptr = ParseNumber(ptr + 1, end, day);
+    if (!ptr)
+        return {begin, DateError::Format};
+
+    if (month > 12 || month < 1)
+        return {begin, DateError::Month};
+    if (day > 31 || day < 1)
+        return {begin, DateError::Day};
+
+    date.emplace(year, month, day);
+    return {ptr, DateError::None};
+}
+
+// Days are counted in 400-year eras starting from March,
+// so the leap day is the last day of a year
+int64_t DateToDays(const Date &date) {
+    const int64_t year = date.GetYear() - (date.GetMonth() <= 2 ? 1 : 0);
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const int64_t year_of_era = year - era * 400;
+    const int64_t month = date.GetMonth() > 2 ? date.GetMonth() - 3 : date.GetMonth() + 9;
+    const int64_t day_of_year = (153 * month + 2) / 5 + date.GetDay() - 1;
+    const int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+Date DaysToDate(int64_t days) {
+    days += 719468;
+    const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const int64_t day_of_era = days - era * 146097;
+    const int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    const int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const int64_t month = (5 * day_of_year + 2) / 153;
+    const int day = static_cast<int>(day_of_year - (153 * month + 2) / 5 + 1);
+    const int civil_month = static_cast<int>(month < 10 ? month + 3 : month - 9);
+    const int64_t year = year_of_era + era * 400 + (civil_month <= 2 ? 1 : 0);
+    return Date(static_cast<int>(year), civil_month, day);
+}
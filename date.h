@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
+#include <optional>
 #include <set>
 #include <string>
 #include <tuple>
@@ -39,7 +41,33 @@ bool operator>(const Date &lhs, const Date &rhs);
 
 std::ostream &operator<<(std::ostream &stream, const Date &date);
 
+// Length of a date written as YYYY-MM-DD
+const size_t DATE_FORMAT_LENGTH = 10;
+
+// Writes date into buffer of DATE_FORMAT_LENGTH chars exactly as operator<< does,
+// returns false if the year does not fit into four digits and nothing was written
+bool FormatDate(const Date &date, char *buffer);
+
 std::ostream &operator<<(std::ostream &stream,
                          const std::pair<Date, std::set<std::string>> &events);
 
 Date ParseDate(std::istream &date_stream);
+
+enum class DateError {
+    None, Format, Month, Day
+};
+
+// Where parsing stopped and why, in the manner of std::from_chars_result
+struct DateParseResult {
+    const char *ptr;
+    DateError error;
+};
+
+// Error code counterpart of ParseDate over raw characters, accepts exactly what ParseDate accepts.
+// On success date is set and ptr points past the date, otherwise ptr is begin.
+DateParseResult ParseDate(const char *begin, const char *end, std::optional<Date> &date);
+
+// Number of days since 1970-01-01 in the proleptic Gregorian calendar
+int64_t DateToDays(const Date &date);
+
+Date DaysToDate(int64_t days);
@@ -0,0 +1,372 @@
+#include "event_bucket.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+const size_t MIN_INDEX_SIZE = 8;
+
+// Both halves are folded in, as size_t has no upper half on 32-bit targets
+uint32_t EventHash(std::string_view event) {
+    const uint64_t hash = std::hash<std::string_view>()(event);
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+uint32_t SlotHash(uint64_t slot) {
+    return static_cast<uint32_t>(slot >> 32);
+}
+
+size_t SlotIndex(uint64_t slot) {
+    return static_cast<uint32_t>(slot) - 1;
+}
+
+uint64_t MakeSlot(uint32_t hash, size_t index) {
+    return (static_cast<uint64_t>(hash) << 32) | static_cast<uint32_t>(index + 1);
+}
+
+// Smallest table which holds size events under the maximum load factor of 3/4
+size_t IndexSizeFor(size_t size) {
+    size_t index_size = MIN_INDEX_SIZE;
+    while (size * 4 > index_size * 3) {
+        index_size *= 2;
+    }
+    return index_size;
+}
+
+void WriteVarint(std::string &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
+
+uint64_t ReadVarint(const char *&current) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        const auto byte = static_cast<unsigned char>(*current++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return value;
+    }
+}
+
+template<typename Vector>
+void ShrinkVectorIfSparse(Vector &vector) {
+    if (vector.size() * 4 < vector.capacity())
+        Vector(vector.begin(), vector.end()).swap(vector);
+}
+
+}
+
+size_t BucketMemoryUsage::Total() const {
+    return data + offsets + prefixes + index + packed;
+}
+
+BucketMemoryUsage &BucketMemoryUsage::operator+=(const BucketMemoryUsage &other) {
+    data += other.data;
+    offsets += other.offsets;
+    prefixes += other.prefixes;
+    index += other.index;
+    packed += other.packed;
+    return *this;
+}
+
+BucketMemoryUsage &BucketMemoryUsage::operator-=(const BucketMemoryUsage &other) {
+    data -= other.data;
+    offsets -= other.offsets;
+    prefixes -= other.prefixes;
+    index -= other.index;
+    packed -= other.packed;
+    return *this;
+}
+
+void FillMask(EventMask &mask, size_t size, bool value) {
+    mask.assign((size + 63) / 64, value ? ~uint64_t(0) : 0);
+
+    if (value && size % 64 != 0)
+        mask.back() = (uint64_t(1) << (size % 64)) - 1;
+}
+
+bool IsMaskEmpty(const EventMask &mask) {
+    for (uint64_t word : mask) {
+        if (word != 0)
+            return false;
+    }
+    return true;
+}
+
+bool IsMaskFull(const EventMask &mask, size_t size) {
+    for (size_t i = 0; i < size / 64; ++i) {
+        if (mask[i] != ~uint64_t(0))
+            return false;
+    }
+    return size % 64 == 0 || mask.back() == (uint64_t(1) << (size % 64)) - 1;
+}
+
+uint64_t EventPrefix(std::string_view event) {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        prefix <<= 8;
+        if (i < event.size())
+            prefix |= static_cast<unsigned char>(event[i]);
+    }
+    return prefix;
+}
+
+EventBucket::EventBucket() : offsets(1, 0) {
+}
+
+void EventBucket::Append(std::string_view event) {
+    ReserveIndex();
+    PlaceIndex(EventHash(event), Size());
+
+    data.append(event.data(), event.size());
+    offsets.push_back(static_cast<uint32_t>(data.size()));
+    prefixes.push_back(EventPrefix(event));
+}
+
+bool EventBucket::Insert(std::string_view event) {
+    ReserveIndex();
+
+    const uint32_t hash = EventHash(event);
+    const size_t slot = FindSlot(event, hash);
+    if (slots[slot] != 0)
+        return false;
+
+    slots[slot] = MakeSlot(hash, Size());
+
+    data.append(event.data(), event.size());
+    offsets.push_back(static_cast<uint32_t>(data.size()));
+    prefixes.push_back(EventPrefix(event));
+    return true;
+}
+
+bool EventBucket::Contains(std::string_view event) const {
+    return !slots.empty() && slots[FindSlot(event, EventHash(event))] != 0;
+}
+
+size_t EventBucket::FindSlot(std::string_view event, uint32_t hash) const {
+    const size_t mask = slots.size() - 1;
+
+    size_t slot = hash & mask;
+    while (slots[slot] != 0 && (SlotHash(slots[slot]) != hash || At(SlotIndex(slots[slot])) != event)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void EventBucket::PlaceIndex(uint32_t hash, size_t index) {
+    const size_t mask = slots.size() - 1;
+
+    size_t slot = hash & mask;
+    while (slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    slots[slot] = MakeSlot(hash, index);
+}
+
+void EventBucket::ReserveIndex() {
+    if ((Size() + 1) * 4 <= slots.size() * 3)
+        return;
+
+    std::vector<uint64_t> old_slots(std::max(slots.size() * 2, MIN_INDEX_SIZE), 0);
+    old_slots.swap(slots);
+
+    for (uint64_t slot : old_slots) {
+        if (slot != 0)
+            PlaceIndex(SlotHash(slot), SlotIndex(slot));
+    }
+}
+
+void EventBucket::Reindex(const std::vector<uint32_t> &positions) {
+    std::vector<uint64_t> old_slots(Empty() ? 0 : std::min(slots.size(), IndexSizeFor(Size())), 0);
+    old_slots.swap(slots);
+
+    for (uint64_t slot : old_slots) {
+        if (slot != 0 && positions[SlotIndex(slot)] != 0)
+            PlaceIndex(SlotHash(slot), positions[SlotIndex(slot)] - 1);
+    }
+}
+
+size_t EventBucket::Size() const {
+    return compressed || spilled ? packed_size : offsets.size() - 1;
+}
+
+bool EventBucket::Empty() const {
+    return Size() == 0;
+}
+
+std::string_view EventBucket::At(size_t index) const {
+    return std::string_view(data.data() + offsets[index], offsets[index + 1] - offsets[index]);
+}
+
+std::string_view EventBucket::Back() const {
+    return At(Size() - 1);
+}
+
+size_t EventBucket::RemoveMasked(const EventMask &mask) {
+    return RemoveIndexIf([&mask](size_t index) {
+        return (mask[index / 64] >> (index % 64)) & 1;
+    });
+}
+
+EventBucket::Iterator EventBucket::begin() const {
+    return Iterator(this, 0);
+}
+
+EventBucket::Iterator EventBucket::end() const {
+    return Iterator(this, Size());
+}
+
+const char *EventBucket::Data() const {
+    return data.data();
+}
+
+const uint32_t *EventBucket::Offsets() const {
+    return offsets.data();
+}
+
+const uint64_t *EventBucket::Prefixes() const {
+    return prefixes.data();
+}
+
+void EventBucket::ShrinkIfSparse() {
+    if (data.size() * 4 < data.capacity())
+        data.shrink_to_fit();
+
+    ShrinkVectorIfSparse(offsets);
+    ShrinkVectorIfSparse(prefixes);
+}
+
+BucketMemoryUsage EventBucket::MemoryUsage() const {
+    BucketMemoryUsage usage;
+    usage.data = StringHeapBytes(data);
+    usage.offsets = offsets.capacity() * sizeof(uint32_t);
+    usage.prefixes = prefixes.capacity() * sizeof(uint64_t);
+    usage.index = slots.capacity() * sizeof(uint64_t);
+    usage.packed = StringHeapBytes(packed);
+    return usage;
+}
+
+bool EventBucket::IsCompressed() const {
+    return compressed;
+}
+
+std::string EventBucket::Pack() const {
+    if (compressed)
+        return packed;
+
+    std::string result;
+    WriteVarint(result, data.size());
+
+    std::string_view previous;
+    for (std::string_view event : *this) {
+        const size_t limit = std::min(previous.size(), event.size());
+        size_t shared = 0;
+        while (shared < limit && previous[shared] == event[shared]) {
+            ++shared;
+        }
+
+        WriteVarint(result, shared);
+        WriteVarint(result, event.size() - shared);
+        result.append(event.data() + shared, event.size() - shared);
+        previous = event;
+    }
+
+    return result;
+}
+
+void EventBucket::Compress() {
+    if (compressed || spilled)
+        return;
+
+    packed_size = static_cast<uint32_t>(Size());
+    packed = Pack();
+    packed.shrink_to_fit();
+    compressed = true;
+
+    std::string().swap(data);
+    std::vector<uint32_t>().swap(offsets);
+    std::vector<uint64_t>().swap(prefixes);
+    std::vector<uint64_t>().swap(slots);
+}
+
+bool EventBucket::IsSpilled() const {
+    return spilled;
+}
+
+void EventBucket::Spill() {
+    Compress();
+    std::string().swap(packed);
+    compressed = false;
+    spilled = true;
+}
+
+EventBucket EventBucket::FromPacked(std::string packed, size_t size) {
+    EventBucket bucket;
+    std::vector<uint32_t>().swap(bucket.offsets);
+    bucket.packed = std::move(packed);
+    bucket.packed_size = static_cast<uint32_t>(size);
+    bucket.compressed = true;
+    return bucket;
+}
+
+void EventBucket::Inflate() {
+    if (!compressed)
+        return;
+
+    EventBucket bucket;
+    Unpack(packed, packed_size, bucket);
+
+    bucket.slots.assign(IndexSizeFor(bucket.Size()), 0);
+    for (size_t i = 0; i < bucket.Size(); ++i) {
+        bucket.PlaceIndex(EventHash(bucket.At(i)), i);
+    }
+
+    // moving an empty string in keeps the old buffer
+    *this = std::move(bucket);
+    std::string().swap(packed);
+}
+
+const EventBucket &EventBucket::Readable(EventBucket &scratch) const {
+    if (!compressed)
+        return *this;
+
+    Unpack(packed, packed_size, scratch);
+    return scratch;
+}
+
+void EventBucket::Unpack(std::string_view packed, size_t size, EventBucket &bucket) {
+    const char *current = packed.data();
+
+    bucket.data.resize(ReadVarint(current));
+    bucket.offsets.assign(1, 0);
+    bucket.offsets.reserve(size + 1);
+    bucket.prefixes.clear();
+    bucket.prefixes.reserve(size);
+    bucket.slots.clear();
+    bucket.packed.clear();
+    bucket.packed_size = 0;
+    bucket.compressed = false;
+    bucket.spilled = false;
+
+    char *output = &bucket.data[0];
+    uint32_t previous = 0;
+    for (size_t i = 0; i < size; ++i) {
+        const size_t shared = ReadVarint(current);
+        const size_t rest = ReadVarint(current);
+
+        const uint32_t begin = bucket.offsets.back();
+        std::memcpy(output + begin, output + previous, shared);
+        std::memcpy(output + begin + shared, current, rest);
+        current += rest;
+
+        const uint32_t end = static_cast<uint32_t>(begin + shared + rest);
+        bucket.offsets.push_back(end);
+        bucket.prefixes.push_back(EventPrefix(std::string_view(output + begin, end - begin)));
+        previous = begin;
+    }
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One bit per event of a bucket, bit i of word i / 64 stands for event i
+using EventMask = std::vector<uint64_t>;
+
+// Sets mask to size bits all equal to value, bits past size stay zero
+void FillMask(EventMask &mask, size_t size, bool value);
+
+bool IsMaskEmpty(const EventMask &mask);
+
+bool IsMaskFull(const EventMask &mask, size_t size);
+
+// First 8 bytes of event packed big-endian and padded with zeros,
+// so comparing prefixes as integers orders events lexicographically
+uint64_t EventPrefix(std::string_view event);
+
+// FNV-1a of the event, the same with every standard library and on every target,
+// with both of its halves well mixed, so they can pick counters independently
+inline uint64_t StableEventHash(std::string_view event) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : event) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Heap bytes held by event buckets, by component
+struct BucketMemoryUsage {
+    size_t data = 0;
+    size_t offsets = 0;
+    size_t prefixes = 0;
+    size_t index = 0;
+    size_t packed = 0;
+
+    size_t Total() const;
+
+    BucketMemoryUsage &operator+=(const BucketMemoryUsage &other);
+
+    BucketMemoryUsage &operator-=(const BucketMemoryUsage &other);
+};
+
+// Events of a single date stored back-to-back in one byte buffer.
+// Event i occupies [offsets[i], offsets[i + 1]) of data, so scanning
+// a bucket is one linear read and there are no per-event allocations.
+// prefixes[i] caches EventPrefix of event i for batched comparisons.
+// slots is an open-addressing hash set of the events for duplicate checks.
+//
+// A bucket which is mostly read may be compressed: all of the above is dropped
+// for the front-coded events in packed. A compressed bucket only answers Size,
+// Empty and MemoryUsage, it is read through Readable and written after Inflate.
+// A spilled bucket keeps nothing but its size, its packed events live elsewhere
+// and are read with Unpack or brought back by FromPacked.
+class EventBucket {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = std::string_view;
+
+        Iterator(const EventBucket *bucket, size_t index) : bucket(bucket), index(index) {}
+
+        std::string_view operator*() const {
+            return bucket->At(index);
+        }
+
+        Iterator &operator++() {
+            ++index;
+            return *this;
+        }
+
+        bool operator==(const Iterator &other) const {
+            return index == other.index;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return index != other.index;
+        }
+
+    private:
+        const EventBucket *bucket;
+        size_t index;
+    };
+
+    EventBucket();
+
+    // Appends the event without checking for duplicates
+    void Append(std::string_view event);
+
+    // Appends the event unless the bucket already has it, returns whether it was appended
+    bool Insert(std::string_view event);
+
+    bool Contains(std::string_view event) const;
+
+    size_t Size() const;
+
+    bool Empty() const;
+
+    std::string_view At(size_t index) const;
+
+    std::string_view Back() const;
+
+    Iterator begin() const;
+
+    Iterator end() const;
+
+    const char *Data() const;
+
+    const uint32_t *Offsets() const;
+
+    const uint64_t *Prefixes() const;
+
+    // Stable in-place removal, returns the number of removed events
+    template<typename Predicate>
+    size_t RemoveIf(Predicate predicate) {
+        return RemoveIndexIf([this, predicate](size_t index) {
+            return predicate(At(index));
+        });
+    }
+
+    // Removes events which have their bit set in mask
+    size_t RemoveMasked(const EventMask &mask);
+
+    BucketMemoryUsage MemoryUsage() const;
+
+    bool IsCompressed() const;
+
+    // Front-coded events as Compress stores them
+    std::string Pack() const;
+
+    // Front-codes the events and frees the plain representation
+    void Compress();
+
+    bool IsSpilled() const;
+
+    // Frees all events, the caller keeps them from Pack
+    void Spill();
+
+    // Compressed bucket of size events packed as Pack does
+    static EventBucket FromPacked(std::string packed, size_t size);
+
+    // Decodes size packed events into the plain representation of bucket, leaving its index empty
+    static void Unpack(std::string_view packed, size_t size, EventBucket &bucket);
+
+    // Restores the plain representation together with the duplicate index
+    void Inflate();
+
+    // The bucket itself, or for a compressed bucket its events decoded into scratch.
+    // The scratch bucket has no duplicate index and is meant for reading only.
+    const EventBucket &Readable(EventBucket &scratch) const;
+
+private:
+    template<typename IndexPredicate>
+    size_t RemoveIndexIf(IndexPredicate predicate) {
+        size_t kept = 0;
+        uint32_t write_offset = 0;
+
+        // new position + 1 of every event, zero for removed ones
+        std::vector<uint32_t> positions(Size(), 0);
+
+        for (size_t i = 0; i < Size(); ++i) {
+            const uint32_t begin = offsets[i];
+            const uint32_t length = offsets[i + 1] - begin;
+
+            if (predicate(i))
+                continue;
+
+            positions[i] = static_cast<uint32_t>(kept + 1);
+
+            if (write_offset != begin)
+                std::memmove(&data[write_offset], data.data() + begin, length);
+
+            offsets[kept] = write_offset;
+            prefixes[kept] = prefixes[i];
+            write_offset += length;
+            kept++;
+        }
+
+        const size_t removed = Size() - kept;
+        offsets[kept] = write_offset;
+        offsets.resize(kept + 1);
+        prefixes.resize(kept);
+        data.resize(write_offset);
+
+        if (removed != 0) {
+            Reindex(positions);
+            ShrinkIfSparse();
+        }
+
+        return removed;
+    }
+
+    // Slot of the event, or the free slot where probing for it stopped
+    size_t FindSlot(std::string_view event, uint32_t hash) const;
+
+    // Puts the event at index into the first free slot of its probe sequence
+    void PlaceIndex(uint32_t hash, size_t index);
+
+    // Makes sure one more event fits under the maximum load factor
+    void ReserveIndex();
+
+    // Moves slots to the new positions of the events after a removal,
+    // the table shrinks when the events fit into a smaller one
+    void Reindex(const std::vector<uint32_t> &positions);
+
+    // Gives memory back after removals left most of the capacity unused
+    void ShrinkIfSparse();
+
+    std::string data;
+    std::vector<uint32_t> offsets;
+    std::vector<uint64_t> prefixes;
+
+    // Upper 32 bits are the event hash, which also chooses the home slot, so the
+    // table is rebuilt without hashing events again. Lower 32 bits are index + 1,
+    // zero marks a free slot. The size is zero or a power of two.
+    std::vector<uint64_t> slots;
+
+    // For every event the length of the prefix shared with the previous event and
+    // the length of the rest as varints, followed by the rest. Starts with the total
+    // length of the events, so unpacking allocates once.
+    std::string packed;
+    uint32_t packed_size = 0;
+    bool compressed = false;
+    bool spilled = false;
+};
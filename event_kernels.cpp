@@ -0,0 +1,255 @@
+#include "event_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define EVENT_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Result of comparing up to 64 rows against the value, bit i stands for row begin + i
+struct Classification {
+    uint64_t less = 0;          // prefix of event < prefix of value
+    uint64_t greater = 0;       // prefix of event > prefix of value
+    uint64_t same_length = 0;   // event has the same length as value
+};
+
+using ClassifyFunction = Classification (*)(const uint32_t *offsets, const uint64_t *prefixes,
+                                            size_t begin, size_t end, uint32_t length, uint64_t prefix);
+
+Classification ClassifyScalar(const uint32_t *offsets, const uint64_t *prefixes,
+                              size_t begin, size_t end, uint32_t length, uint64_t prefix) {
+    Classification result;
+
+    for (size_t i = begin; i < end; ++i) {
+        const uint64_t bit = uint64_t(1) << (i - begin);
+
+        if (prefixes[i] < prefix)
+            result.less |= bit;
+        else if (prefixes[i] > prefix)
+            result.greater |= bit;
+
+        if (offsets[i + 1] - offsets[i] == length)
+            result.same_length |= bit;
+    }
+
+    return result;
+}
+
+#ifdef EVENT_KERNELS_X86
+
+Classification ClassifySse2(const uint32_t *offsets, const uint64_t *prefixes,
+                            size_t begin, size_t end, uint32_t length, uint64_t prefix) {
+    Classification result;
+    size_t i = begin;
+
+    const __m128i length_vector = _mm_set1_epi32(static_cast<int>(length));
+    for (; i + 4 <= end; i += 4) {
+        const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(offsets + i));
+        const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(offsets + i + 1));
+        const __m128i equal = _mm_cmpeq_epi32(_mm_sub_epi32(hi, lo), length_vector);
+        result.same_length |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(equal))) << (i - begin);
+    }
+    for (; i < end; ++i) {
+        if (offsets[i + 1] - offsets[i] == length)
+            result.same_length |= uint64_t(1) << (i - begin);
+    }
+
+    // SSE2 has no 64-bit compare, so it is assembled from 32-bit halves:
+    // a > b <=> hi(a) > hi(b) || (hi(a) == hi(b) && lo(a) > lo(b)), all unsigned
+    const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000u));
+    const __m128i prefix_vector = _mm_xor_si128(_mm_set1_epi64x(static_cast<long long>(prefix)), sign);
+    for (i = begin; i + 2 <= end; i += 2) {
+        const __m128i current = _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(prefixes + i)), sign);
+
+        const __m128i equal = _mm_cmpeq_epi32(current, prefix_vector);
+        const __m128i greater = _mm_cmpgt_epi32(current, prefix_vector);
+        const __m128i less = _mm_cmpgt_epi32(prefix_vector, current);
+
+        // move low halves results into high halves positions
+        const __m128i greater_low = _mm_shuffle_epi32(greater, _MM_SHUFFLE(2, 2, 0, 0));
+        const __m128i less_low = _mm_shuffle_epi32(less, _MM_SHUFFLE(2, 2, 0, 0));
+
+        const __m128i greater64 = _mm_or_si128(greater, _mm_and_si128(equal, greater_low));
+        const __m128i less64 = _mm_or_si128(less, _mm_and_si128(equal, less_low));
+
+        result.greater |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(greater64))) << (i - begin);
+        result.less |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(less64))) << (i - begin);
+    }
+    for (; i < end; ++i) {
+        const uint64_t bit = uint64_t(1) << (i - begin);
+        if (prefixes[i] < prefix)
+            result.less |= bit;
+        else if (prefixes[i] > prefix)
+            result.greater |= bit;
+    }
+
+    return result;
+}
+
+__attribute__((target("avx2")))
+Classification ClassifyAvx2(const uint32_t *offsets, const uint64_t *prefixes,
+                            size_t begin, size_t end, uint32_t length, uint64_t prefix) {
+    Classification result;
+    size_t i = begin;
+
+    const __m256i length_vector = _mm256_set1_epi32(static_cast<int>(length));
+    for (; i + 8 <= end; i += 8) {
+        const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(offsets + i));
+        const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(offsets + i + 1));
+        const __m256i equal = _mm256_cmpeq_epi32(_mm256_sub_epi32(hi, lo), length_vector);
+        result.same_length |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(equal))) << (i - begin);
+    }
+    for (; i < end; ++i) {
+        if (offsets[i + 1] - offsets[i] == length)
+            result.same_length |= uint64_t(1) << (i - begin);
+    }
+
+    // _mm256_cmpgt_epi64 is signed, flipping the sign bit makes it unsigned
+    const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(0x8000000000000000ull));
+    const __m256i prefix_vector = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(prefix)), sign);
+    for (i = begin; i + 4 <= end; i += 4) {
+        const __m256i current = _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(prefixes + i)), sign);
+
+        const __m256i greater = _mm256_cmpgt_epi64(current, prefix_vector);
+        const __m256i less = _mm256_cmpgt_epi64(prefix_vector, current);
+
+        result.greater |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(greater))) << (i - begin);
+        result.less |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(less))) << (i - begin);
+    }
+    for (; i < end; ++i) {
+        const uint64_t bit = uint64_t(1) << (i - begin);
+        if (prefixes[i] < prefix)
+            result.less |= bit;
+        else if (prefixes[i] > prefix)
+            result.greater |= bit;
+    }
+
+    return result;
+}
+
+#endif
+
+bool CompareFull(std::string_view event, Comparison comparison, std::string_view value) {
+    switch (comparison) {
+        case Comparison::Equal:
+            return event == value;
+        case Comparison::Greater:
+            return event > value;
+        case Comparison::GreaterOrEqual:
+            return event >= value;
+        case Comparison::Less:
+            return event < value;
+        case Comparison::LessOrEqual:
+            return event <= value;
+        case Comparison::NotEqual:
+            return event != value;
+    }
+    return false;
+}
+
+void CompareWith(ClassifyFunction classify, const EventBucket &bucket, Comparison comparison,
+                 std::string_view value, EventMask &mask) {
+    const size_t size = bucket.Size();
+    const char *data = bucket.Data();
+    const uint32_t *offsets = bucket.Offsets();
+    const uint64_t *prefixes = bucket.Prefixes();
+
+    const uint32_t length = static_cast<uint32_t>(value.size());
+    const uint64_t prefix = EventPrefix(value);
+
+    mask.assign((size + 63) / 64, 0);
+
+    for (size_t word = 0; word < mask.size(); ++word) {
+        const size_t begin = word * 64;
+        const size_t end = std::min(size, begin + 64);
+        const uint64_t valid = end - begin == 64 ? ~uint64_t(0) : (uint64_t(1) << (end - begin)) - 1;
+
+        const Classification classification = classify(offsets, prefixes, begin, end, length, prefix);
+
+        // rows with equal prefixes, only they may need a full comparison
+        uint64_t ties = valid & ~(classification.less | classification.greater);
+
+        if (comparison == Comparison::Equal || comparison == Comparison::NotEqual) {
+            uint64_t equal = ties & classification.same_length;
+
+            // prefix covers the whole value for short values, otherwise compare tails
+            if (length > 8) {
+                for (uint64_t candidates = equal; candidates; candidates &= candidates - 1) {
+                    const size_t i = begin + __builtin_ctzll(candidates);
+                    if (std::memcmp(data + offsets[i] + 8, value.data() + 8, length - 8) != 0)
+                        equal &= ~(uint64_t(1) << (i - begin));
+                }
+            }
+
+            mask[word] = comparison == Comparison::Equal ? equal : valid & ~equal;
+            continue;
+        }
+
+        uint64_t result = 0;
+        if (comparison == Comparison::Less || comparison == Comparison::LessOrEqual)
+            result = classification.less;
+        else
+            result = classification.greater;
+
+        for (; ties; ties &= ties - 1) {
+            const size_t i = begin + __builtin_ctzll(ties);
+            const std::string_view event(data + offsets[i], offsets[i + 1] - offsets[i]);
+            if (CompareFull(event, comparison, value))
+                result |= uint64_t(1) << (i - begin);
+        }
+
+        mask[word] = result;
+    }
+}
+
+}
+
+KernelLevel DetectKernelLevel() {
+#ifdef EVENT_KERNELS_X86
+    if (__builtin_cpu_supports("avx2"))
+        return KernelLevel::Avx2;
+    return KernelLevel::Sse2;
+#else
+    return KernelLevel::Scalar;
+#endif
+}
+
+namespace {
+
+// The CPU is asked once, as evaluating every bucket looks the level up
+KernelLevel SupportedKernelLevel() {
+    static const KernelLevel level = DetectKernelLevel();
+    return level;
+}
+
+}
+
+void CompareEvents(const EventBucket &bucket, Comparison comparison,
+                   std::string_view value, EventMask &mask) {
+    CompareEvents(bucket, comparison, value, mask, SupportedKernelLevel());
+}
+
+void CompareEvents(const EventBucket &bucket, Comparison comparison,
+                   std::string_view value, EventMask &mask, KernelLevel level) {
+    level = std::min(level, SupportedKernelLevel());
+
+    switch (level) {
+#ifdef EVENT_KERNELS_X86
+        case KernelLevel::Avx2:
+            CompareWith(ClassifyAvx2, bucket, comparison, value, mask);
+            return;
+        case KernelLevel::Sse2:
+            CompareWith(ClassifySse2, bucket, comparison, value, mask);
+            return;
+#endif
+        default:
+            CompareWith(ClassifyScalar, bucket, comparison, value, mask);
+            return;
+    }
+}
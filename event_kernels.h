@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string_view>
+
+#include "event_bucket.h"
+#include "node.h"
+
+enum class KernelLevel {
+    Scalar, Sse2, Avx2
+};
+
+// Best kernel level supported by the running CPU
+KernelLevel DetectKernelLevel();
+
+// Evaluates "event <comparison> value" for all events of bucket at once.
+// Candidates are rejected on length and 8-byte prefix in SIMD registers,
+// only the rows which tie on prefix are compared in full.
+// mask is resized to the bucket size, bit i is set if event i matches.
+void CompareEvents(const EventBucket &bucket, Comparison comparison,
+                   std::string_view value, EventMask &mask);
+
+void CompareEvents(const EventBucket &bucket, Comparison comparison,
+                   std::string_view value, EventMask &mask, KernelLevel level);
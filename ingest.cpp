@@ -0,0 +1,302 @@
+#include "ingest.h"
+#include "commands.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Longest run of Find and Del commands executed in one pass in batch mode
+const size_t MAX_BATCH_SIZE = 1024;
+
+// Bytes of input handed to a parser thread at once, rounded up to whole lines
+const size_t CHUNK_SIZE = 1 << 18;
+
+// Chunks read ahead of execution per parser thread
+const size_t CHUNKS_PER_PARSER = 4;
+
+// Executes parsed commands in order, as the sequential loop of main() did
+class Applier {
+public:
+    Applier(Database &db, std::ostream &output, const IngestOptions &options)
+            : db(db), output(output), options(options) {}
+
+    void Apply(Command &command) {
+        if (command.type == CommandType::Empty)
+            return;
+
+        if (options.batch && IsBatchCommand(command)) {
+            batch.push_back(std::move(command));
+            if (batch.size() == MAX_BATCH_SIZE)
+                Flush();
+            return;
+        }
+
+        Flush();
+        ExecuteCommand(db, command, output);
+    }
+
+    // Line which TryParseCommand did not accept
+    void Reject(const std::string &line) {
+        if (options.skip_bad_lines) {
+            bad_lines++;
+            return;
+        }
+
+        // the throwing parser reports what is wrong with the line,
+        // commands before the malformed one are still executed
+        Command command;
+        try {
+            command = ParseCommand(line);
+        } catch (std::logic_error &) {
+            Flush();
+            throw;
+        }
+        Apply(command);
+    }
+
+    size_t Finish() {
+        Flush();
+        db.Flush();
+        return bad_lines;
+    }
+
+private:
+    void Flush() {
+        ExecuteBatch(db, batch, output);
+        batch.clear();
+    }
+
+    Database &db;
+    std::ostream &output;
+    const IngestOptions &options;
+
+    std::vector<Command> batch;
+    size_t bad_lines = 0;
+};
+
+// Whole lines of input and the commands parsed from them. Lines are kept as
+// offsets, as views would not survive moving a short text kept in place.
+struct Chunk {
+    std::string text;
+    std::vector<std::pair<size_t, size_t>> lines;
+    std::vector<Command> commands;
+    std::vector<ParseStatus> statuses;
+    std::exception_ptr error;
+};
+
+// Splits text as getline would read it, a trailing line feed does not start another line
+void SplitLines(const std::string &text, std::vector<std::pair<size_t, size_t>> &lines) {
+    for (size_t begin = 0; begin < text.size();) {
+        size_t end = text.find('\n', begin);
+        if (end == std::string::npos)
+            end = text.size();
+
+        lines.emplace_back(begin, end - begin);
+        begin = end + 1;
+    }
+}
+
+std::string_view Line(const Chunk &chunk, size_t index) {
+    return std::string_view(chunk.text).substr(chunk.lines[index].first, chunk.lines[index].second);
+}
+
+// Reader thread splitting input into chunks of whole lines, parser threads turning them
+// into commands, and the parsed chunks handed out in the order of the input. The reader
+// stays at most max_in_flight chunks ahead of the chunks taken.
+class Parsers {
+public:
+    Parsers(std::istream &input, size_t count, size_t max_in_flight) : input(input), max_in_flight(max_in_flight) {
+        for (size_t i = 0; i < count; ++i) {
+            threads.emplace_back(&Parsers::Work, this);
+        }
+        reader = std::thread(&Parsers::Read, this);
+    }
+
+    ~Parsers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        chunk_read.notify_all();
+        chunk_taken.notify_all();
+
+        reader.join();
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Waits for the next chunk to be parsed, false once all of the input has been taken
+    bool Take(Chunk &chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        chunk_parsed.wait(lock, [this] {
+            return parsed.count(next_taken) != 0 || (input_done && next_taken == next_read);
+        });
+
+        auto it = parsed.find(next_taken);
+        if (it == parsed.end()) {
+            if (read_error)
+                std::rethrow_exception(read_error);
+            return false;
+        }
+
+        chunk = std::move(it->second);
+        parsed.erase(it);
+        next_taken++;
+        chunk_taken.notify_one();
+        return true;
+    }
+
+private:
+    void Read() {
+        try {
+            // input is read in large blocks, as reading line by line locks the stream
+            // for every character once the process has more than one thread
+            std::string rest;
+            for (bool done = false; !done;) {
+                Chunk chunk;
+                chunk.text.swap(rest);
+
+                const size_t size = chunk.text.size();
+                chunk.text.resize(size + CHUNK_SIZE);
+                input.read(&chunk.text[size], CHUNK_SIZE);
+                chunk.text.resize(size + input.gcount());
+                done = !input;
+
+                // a line cut by the end of the block goes with the next chunk
+                const size_t last_line_feed = chunk.text.rfind('\n');
+                if (!done) {
+                    const size_t cut = last_line_feed == std::string::npos ? 0 : last_line_feed + 1;
+                    rest.assign(chunk.text, cut, std::string::npos);
+                    chunk.text.resize(cut);
+                }
+
+                if (chunk.text.empty())
+                    continue;
+
+                std::unique_lock<std::mutex> lock(mutex);
+                chunk_taken.wait(lock, [this] { return stopping || next_read - next_taken < max_in_flight; });
+                if (stopping)
+                    return;
+
+                read.emplace_back(next_read++, std::move(chunk));
+                chunk_read.notify_one();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            read_error = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            input_done = true;
+        }
+        chunk_parsed.notify_all();
+    }
+
+    void Work() {
+        while (true) {
+            uint64_t sequence;
+            Chunk chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                chunk_read.wait(lock, [this] { return stopping || !read.empty(); });
+                if (stopping)
+                    return;
+
+                sequence = read.front().first;
+                chunk = std::move(read.front().second);
+                read.pop_front();
+            }
+
+            try {
+                SplitLines(chunk.text, chunk.lines);
+                chunk.commands.resize(chunk.lines.size());
+                chunk.statuses.resize(chunk.lines.size());
+                for (size_t i = 0; i < chunk.lines.size(); ++i) {
+                    chunk.statuses[i] = TryParseCommand(Line(chunk, i), chunk.commands[i]);
+                }
+            } catch (...) {
+                chunk.error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                parsed.emplace(sequence, std::move(chunk));
+            }
+            chunk_parsed.notify_all();
+        }
+    }
+
+    std::istream &input;
+    const size_t max_in_flight;
+
+    std::mutex mutex;
+    std::condition_variable chunk_read;
+    std::condition_variable chunk_parsed;
+    std::condition_variable chunk_taken;
+    std::deque<std::pair<uint64_t, Chunk>> read;
+    std::map<uint64_t, Chunk> parsed;
+    uint64_t next_read = 0;
+    uint64_t next_taken = 0;
+    bool input_done = false;
+    std::exception_ptr read_error;
+    bool stopping = false;
+
+    std::vector<std::thread> threads;
+    std::thread reader;
+};
+
+void ApplyChunk(Applier &applier, Chunk &chunk) {
+    if (chunk.error)
+        std::rethrow_exception(chunk.error);
+
+    for (size_t i = 0; i < chunk.commands.size(); ++i) {
+        if (chunk.statuses[i] == ParseStatus::Ok)
+            applier.Apply(chunk.commands[i]);
+        else
+            applier.Reject(std::string(Line(chunk, i)));
+    }
+}
+
+}
+
+size_t RunCommands(Database &db, std::istream &input, std::ostream &output, const IngestOptions &options) {
+    if (options.parser_count > 0)
+        return RunPipeline(db, input, output, options);
+
+    Applier applier(db, output, options);
+
+    for (std::string line; std::getline(input, line);) {
+        Command command;
+        if (TryParseCommand(line, command) == ParseStatus::Ok)
+            applier.Apply(command);
+        else
+            applier.Reject(line);
+    }
+
+    return applier.Finish();
+}
+
+size_t RunPipeline(Database &db, std::istream &input, std::ostream &output, const IngestOptions &options) {
+    const size_t parser_count = std::max<size_t>(options.parser_count, 1);
+
+    Applier applier(db, output, options);
+    Parsers parsers(input, parser_count, parser_count * CHUNKS_PER_PARSER);
+
+    for (Chunk chunk; parsers.Take(chunk);) {
+        ApplyChunk(applier, chunk);
+    }
+
+    return applier.Finish();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <iostream>
+
+#include "database.h"
+
+struct IngestOptions {
+    // runs of Find and Del commands are executed in one pass over the database
+    bool batch = false;
+
+    // malformed lines are counted and skipped instead of throwing logic_error
+    bool skip_bad_lines = false;
+
+    // threads parsing lines ahead of execution, zero parses on the calling thread
+    size_t parser_count = 0;
+};
+
+// Executes the command protocol from input, writing replies to output.
+// Returns the number of skipped bad lines. Without skip_bad_lines the first
+// malformed line throws logic_error after the commands before it are executed.
+// With parser_count set the work goes to RunPipeline.
+size_t RunCommands(Database &db, std::istream &input, std::ostream &output, const IngestOptions &options);
+
+// Same as RunCommands, but a reader thread reads input in chunks of lines,
+// parser threads turn chunks into commands and the calling thread executes
+// them in the original order, so replies are exactly the sequential ones.
+// Reading, parsing and executing overlap. Input is read in large blocks, which
+// suits bulk feeds rather than interactive use: a malformed line is thrown once
+// the reader has finished the block it is reading.
+size_t RunPipeline(Database &db, std::istream &input, std::ostream &output, const IngestOptions &options);
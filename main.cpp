@@ -1,78 +1,79 @@
 #include "database.h"
 #include "date.h"
+#include "commands.h"
 #include "condition_parser.h"
 #include "node.h"
+#include "server.h"
 #include "test_runner.h"
+#include "event_kernels.h"
+#include "ingest.h"
 
 #include <iostream>
+#include <random>
 #include <stdexcept>
+#include <thread>
 
-using namespace std;
-
-string ParseEvent(istream &is) {
-    string event;
-
-    while (is.peek() == ' ')
-        is.ignore(1);
+#include <cstdlib>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-    getline(is, event);
-    return event;
-}
+using namespace std;
 
 void TestAll();
 
-int main() {
+// Tests which start threads or create files and sockets, run only with --system-tests
+void TestSystem();
+
+int main(int argc, char **argv) {
     TestAll();
 
     Database db;
 
-    for (string line; getline(cin, line);) {
-        istringstream is(line);
-
-        string command;
-        is >> command;
-        if (command == "Add") {
-            const Date date = ParseDate(is);
-            const string event = ParseEvent(is);
-            db.Add(date, event);
-        } else if (command == "Print") {
-            db.Print(cout);
-        } else if (command == "Del") {
-            auto condition = ParseCondition(is);
-            auto predicate =
-                    [condition](const Date &date, const string &event) {
-                        return condition->Evaluate(date, event);
-                    };
-            int count = db.RemoveIf(predicate);
-            cout << "Removed " << count << " entries" << endl;
-        } else if (command == "Find") {
-            auto condition = ParseCondition(is);
-            auto predicate =
-                    [condition](const Date &date, const string &event) {
-                        return condition->Evaluate(date, event);
-                    };
-
-            const auto entries = db.FindIf(predicate);
-            for (const auto &entry : entries) {
-                cout << entry.first << " " << entry.second << endl;
-            }
-            cout << "Found " << entries.size() << " entries" << endl;
-        } else if (command == "Last") {
-            try {
-                cout << db.Last(ParseDate(is)) << endl;
-            } catch (invalid_argument &) {
-                cout << "No entries" << endl;
-            }
-        } else if (command.empty()) {
-            continue;
+    string socket_path;
+    IngestOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        const string argument = argv[i];
+        if (argument == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (argument == "--batch") {
+            options.batch = true;
+        } else if (argument == "--skip-bad-lines") {
+            options.skip_bad_lines = true;
+        } else if (argument == "--parsers" && i + 1 < argc) {
+            options.parser_count = stoul(argv[++i]);
+        } else if (argument == "--system-tests") {
+            TestSystem();
+            return 0;
         } else {
-            throw logic_error("Unknown command: " + command);
+            throw invalid_argument("Unknown argument: " + argument);
         }
     }
 
+    if (!socket_path.empty()) {
+        RunServer(db, socket_path, thread::hardware_concurrency());
+        return 0;
+    }
+
+    const size_t bad_lines = RunCommands(db, cin, cout, options);
+
+    if (options.skip_bad_lines) {
+        cerr << "Skipped " << bad_lines << " bad lines" << endl;
+    }
+
     return 0;
 }
 
+string ExecuteCommands(Database &db, const vector<string> &lines) {
+    stringstream os;
+    for (const string &line : lines) {
+        ExecuteCommand(db, ParseCommand(line), os);
+    }
+    return os.str();
+}
+
 void TestParseEvent() {
     {
         istringstream is("event");
@@ -106,7 +107,7 @@ void TestRemoveIf() {
         std::stringstream stream("date > 1992-12-1");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -129,7 +130,7 @@ void TestRemoveIf() {
         std::stringstream stream("date == 1992-12-1 OR date > 1992-12-1");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -152,7 +153,7 @@ void TestRemoveIf() {
         std::stringstream stream("");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -175,7 +176,7 @@ void TestRemoveIf() {
         std::stringstream stream("date == 1992-12-1");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -198,7 +199,7 @@ void TestRemoveIf() {
         std::stringstream stream(R"(event == "tennis")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -221,7 +222,7 @@ void TestRemoveIf() {
         std::stringstream stream(R"(event == "")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -247,7 +248,7 @@ void TestRemoveIf() {
         std::stringstream stream(R"(event == "handball1")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -273,7 +274,7 @@ void TestFindIf() {
         std::stringstream stream("date > 1992-12-1");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -293,7 +294,7 @@ void TestFindIf() {
         std::stringstream stream("date >= 1992-12-1 AND date < 1992-12-10");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -313,7 +314,7 @@ void TestFindIf() {
         std::stringstream stream("date == 1992-12-1 AND event == \"football\"");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -333,7 +334,7 @@ void TestFindIf() {
         std::stringstream stream("event == \"football\"");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -353,7 +354,7 @@ void TestFindIf() {
         std::stringstream stream(R"(event == "football" OR event == "handball")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -373,7 +374,7 @@ void TestFindIf() {
         std::stringstream stream(R"(event == "football" OR (event == "handball" AND date > 1993-1-1))");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -393,13 +394,179 @@ void TestFindIf() {
         std::stringstream stream("");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
         auto result = db.FindIf(predicate);
         AssertEqual(result.size(), 4u, "Find if works incorrectly #7");
     }
+
+    {
+        Database db;
+        db.SetVersionLimit(1);
+
+        const string output = ExecuteCommands(db, {
+                "Add 1992-12-1 tennis",
+                "Add 1992-12-1 football",
+                "Add 1992-12-2 baseball",
+                "Add 1992-12-2 chess",
+                "Add 1992-12-10 handball",
+                "Find LIMIT 2",
+                "Find OFFSET 1 LIMIT 2 event != \"chess\"",
+                "Find DESC LIMIT 3",
+                "Find DESC OFFSET 3",
+                "Find LIMIT 0",
+                "Del date == 1992-12-2",
+                "Find AS OF 0 DESC LIMIT 1 date < 1992-12-10",
+        });
+        const string expected = "1992-12-01 football\n1992-12-01 tennis\nFound 2 entries\n"
+                                "Cursor 1992-12-01/74656e6e6973\n"
+                                "1992-12-01 tennis\n1992-12-02 baseball\nFound 2 entries\n"
+                                "Cursor 1992-12-02/6261736562616c6c\n"
+                                "1992-12-10 handball\n1992-12-02 chess\n1992-12-02 baseball\nFound 3 entries\n"
+                                "Cursor 1992-12-02/6261736562616c6c\n"
+                                "1992-12-01 football\n1992-12-01 tennis\nFound 2 entries\n"
+                                "Found 0 entries\n"
+                                "Removed 2 entries\n"
+                                "1992-12-02 chess\nFound 1 entries\n"
+                                "Cursor 1992-12-02/6368657373\n";
+        AssertEqual(output, expected, "Find if works incorrectly #8");
+    }
+
+    {
+        // rows of a limited query are a slice of the full result ordered by date and event, or of the reversed one
+        Database db;
+        for (int i = 0; i < 1000; ++i) {
+            db.Add(Date(2017, 1 + i % 3, 1 + i % 28), "event " + to_string(i % 13));
+        }
+
+        const auto condition = ParseCommand(R"(Find event >= "event 5")").condition;
+        auto all = db.FindIf(condition);
+        sort(all.begin(), all.end());
+        for (bool descending : {false, true}) {
+            if (descending)
+                reverse(all.begin(), all.end());
+
+            for (size_t offset : {0u, 7u, 100u, 500u}) {
+                FindOptions options;
+                options.offset = offset;
+                options.limit = 40;
+                options.descending = descending;
+                const auto rows = db.FindIf(condition, options).entries;
+                const size_t end = min(all.size(), offset + 40);
+                const vector<pair<Date, string>> expected(all.begin() + min(offset, end), all.begin() + end);
+                Assert(rows == expected, "Find if works incorrectly #9");
+            }
+        }
+    }
+
+    for (bool descending : {false, true}) {
+        // pages from cursors return every row once while rows are added and returned rows removed
+        Database db;
+        for (int i = 0; i < 600; ++i) {
+            db.Add(Date(2017, 1, 1 + i % 20), "event " + to_string(i));
+        }
+
+        const auto condition = ParseCommand(R"(Find event != "event 7")").condition;
+        const auto initial = db.FindIf(condition);
+
+        set<pair<Date, string>> returned;
+        FindOptions options;
+        options.limit = 25;
+        options.descending = descending;
+        for (int page = 0;; ++page) {
+            const FindResult result = db.FindIf(condition, options);
+            for (const auto &entry : result.entries) {
+                Assert(returned.insert(entry).second, "Find if works incorrectly #10#1");
+            }
+            if (!result.cursor)
+                break;
+            options.after = result.cursor;
+
+            // removals move the row of the cursor within its date, adds are appended to it
+            const Date &date = result.cursor->date;
+            db.RemoveIf([&](const Date &entry_date, string_view event) {
+                return entry_date == date && event != result.entries.back().second
+                       && returned.count({entry_date, string(event)}) != 0;
+            });
+            db.Add(date, "added " + to_string(page));
+        }
+
+        for (const auto &entry : initial) {
+            Assert(returned.count(entry) == 1, "Find if works incorrectly #10#2");
+        }
+    }
+
+    for (bool descending : {false, true}) {
+        // the row of the cursor removed together with earlier rows of its date skips nothing
+        Database db;
+        for (int i = 0; i < 60; ++i) {
+            db.Add(Date(2017, 1, 1 + i % 2), "event " + to_string(i));
+        }
+
+        const auto condition = ParseCommand("Find").condition;
+        auto all = db.FindIf(condition);
+        sort(all.begin(), all.end());
+        if (descending)
+            reverse(all.begin(), all.end());
+
+        FindOptions options;
+        options.limit = 10;
+        options.descending = descending;
+        const FindResult first = db.FindIf(condition, options);
+        Assert(first.entries == vector<pair<Date, string>>(all.begin(), all.begin() + 10), "Find if works incorrectly #11#1");
+
+        const string cursor_event = first.cursor->event;
+        const string earlier_event = first.entries[first.entries.size() - 3].second;
+        db.RemoveIf([&](const Date &, string_view event) { return event == cursor_event || event == earlier_event; });
+
+        options.after = first.cursor;
+        options.limit = nullopt;
+        Assert(db.FindIf(condition, options).entries == vector<pair<Date, string>>(all.begin() + 10, all.end()),
+               "Find if works incorrectly #11#2");
+    }
+    {
+        // a cursor made of an event with spaces goes through the command line
+        Database db;
+        const string output = ExecuteCommands(db, {
+                "Add 2017-1-1 a b",
+                "Add 2017-1-1 a c",
+                "Add 2017-1-1 a d",
+                "Find LIMIT 1",
+                "Del event == \"a b\"",
+                "Find AFTER 2017-01-01/612062",
+        });
+        const string expected = "2017-01-01 a b\nFound 1 entries\nCursor 2017-01-01/612062\n"
+                                "Removed 1 entries\n"
+                                "2017-01-01 a c\n2017-01-01 a d\nFound 2 entries\n";
+        AssertEqual(output, expected, "Find if works incorrectly #12");
+    }
+}
+
+void TestCountIf() {
+    Database db;
+
+    db.Add(Date(1992, 12, 1), "tennis");
+    db.Add(Date(1992, 12, 1), "football");
+    db.Add(Date(1992, 12, 2), "baseball");
+    db.Add(Date(1992, 12, 10), "handball");
+
+    const vector<pair<string, int>> expected = {
+            {"",                                                4},
+            {"date > 1992-12-1",                                2},
+            {R"(event == "football" OR date == 1992-12-10)",    2},
+            {R"(event == "chess")",                             0},
+            {"date < 1992-12-1",                                0},
+    };
+
+    for (const auto &item : expected) {
+        std::stringstream stream(item.first);
+        shared_ptr<Node> condition = ParseCondition(stream);
+
+        AssertEqual(db.CountIf(condition), item.second, "Count if works incorrectly for: " + item.first);
+        AssertEqual(db.ExistsIf(condition), item.second > 0, "Exists if works incorrectly for: " + item.first);
+    }
 }
 
 void TestLast() {
@@ -462,7 +629,7 @@ void TestLast() {
         std::stringstream stream(R"(event == "handball")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -498,7 +665,7 @@ void TestLast() {
         std::stringstream stream(R"(event == "baseball")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -548,7 +715,7 @@ void TestLast() {
         std::stringstream stream(R"(date == "1998-12-1")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -565,7 +732,7 @@ void TestLast() {
         std::stringstream stream(R"(event == "tennis")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -590,7 +757,7 @@ void TestLast() {
         std::stringstream stream(R"(event == "ping pong")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -615,7 +782,7 @@ void TestLast() {
         std::stringstream stream(R"(event == "ping pong")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -644,7 +811,7 @@ void TestLast() {
         std::stringstream stream(R"(date == 1998-12-5 OR date == 1998-12-6)");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -666,7 +833,7 @@ void TestLast() {
         std::stringstream stream(R"(event == "event")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -690,7 +857,7 @@ void TestLast() {
         std::stringstream stream(R"(event != "handball1")");
         shared_ptr<Node> condition = ParseCondition(stream);
 
-        auto predicate = [condition](const Date &date, const string &event) {
+        auto predicate = [condition](const Date &date, string_view event) {
             return condition->Evaluate(date, event);
         };
 
@@ -698,6 +865,806 @@ void TestLast() {
         auto result = db.Last(Date(1998, 12, 1));
         AssertEqual(result, "1992-12-01 handball1", "Last works incorrectly #14");
     }
+
+    {
+        Database db;
+        db.SetVersionLimit(1);
+
+        const string output = ExecuteCommands(db, {
+                "Add 1992-12-1 tennis",
+                "Add 1992-12-1 football",
+                "Add 1992-12-2 tennis",
+                "Add 1992-12-2 chess",
+                "Add 1992-12-3 football",
+                "Last 1992-12-2 event == \"tennis\"",
+                "Last 1992-12-5 event == \"football\" AND date < 1992-12-3",
+                "Last 1992-12-5 event == \"golf\"",
+                "Last 1992-12-5 date < 1992-12-2",
+                "Last 1992-12-5",
+                "Del event == \"tennis\"",
+                "Last 1992-12-5 event == \"tennis\"",
+                "Last AS OF 0 1992-12-5 event == \"tennis\"",
+        });
+        const string expected = "1992-12-02 tennis\n"
+                                "1992-12-01 football\n"
+                                "No entries\n"
+                                "1992-12-01 football\n"
+                                "1992-12-03 football\n"
+                                "Removed 2 entries\n"
+                                "No entries\n"
+                                "1992-12-02 tennis\n";
+        AssertEqual(output, expected, "Last works incorrectly #15");
+    }
+}
+
+void TestDateRange() {
+    const vector<pair<string, string>> expected = {
+            {"",                                                    "(-inf, +inf)"},
+            {"date > 2017-1-1",                                     "(2017-01-01, +inf)"},
+            {"date >= 2017-1-1 AND date < 2017-2-1",                "[2017-01-01, 2017-02-01)"},
+            {"date == 2017-1-1 OR date == 2017-3-1",                "[2017-01-01, 2017-03-01]"},
+            {R"(date <= 2017-1-1 OR event == "a")",                 "(-inf, +inf)"},
+            {R"(date <= 2017-1-1 AND event == "a")",                "(-inf, 2017-01-01]"},
+            {"date != 2017-1-1 AND date >= 2017-1-1",               "(2017-01-01, +inf)"},
+            {"date > 2017-1-1 AND date <= 2017-1-1",                "empty"},
+            {"(date > 2017-1-1 AND date < 2016-1-1) OR date == 2015-1-1", "[2015-01-01, 2015-01-01]"},
+    };
+
+    for (const auto &item : expected) {
+        std::stringstream stream(item.first);
+        const DateRange range = ParseCondition(stream)->GetDateRange();
+
+        stringstream os;
+        os << range;
+
+        AssertEqual(os.str(), item.second, "Date range works incorrectly for: " + item.first);
+    }
+
+    {
+        Database db;
+
+        for (int day = 1; day <= 31; ++day) {
+            db.Add(Date(2017, 1, day), "event");
+            db.Add(Date(2017, 1, day), "another event");
+        }
+
+        std::stringstream stream("date >= 2017-1-10 AND date < 2017-1-20 AND date != 2017-1-15");
+        AssertEqual(db.RemoveIf(ParseCondition(stream)), 18, "Date only remove works incorrectly #1");
+        AssertEqual(db.GetHistorySize(), 22, "Date only remove works incorrectly #2");
+        AssertEqual(db.GetStorageSize(), 22, "Date only remove works incorrectly #3");
+        AssertEqual(db.Last(Date(2017, 1, 19)), "2017-01-15 another event", "Date only remove works incorrectly #4");
+    }
+}
+
+void TestSimplifyCondition() {
+    auto parse = [](const string &condition) {
+        std::stringstream stream(condition);
+        return ParseCondition(stream);
+    };
+    auto operand_count = [](const shared_ptr<Node> &node) -> size_t {
+        const auto logical = dynamic_pointer_cast<LogicalOperationNode>(node);
+        return logical ? logical->GetOperands().size() : 1;
+    };
+
+    Assert(dynamic_pointer_cast<FalseNode>(parse("date > 2017-1-1 AND date < 2016-1-1")) != nullptr,
+           "Simplification works incorrectly #1");
+    Assert(dynamic_pointer_cast<FalseNode>(parse("date == 2017-1-1 AND date != 2017-1-1")) != nullptr,
+           "Simplification works incorrectly #2");
+    Assert(dynamic_pointer_cast<FalseNode>(parse(R"((date < 2016-1-1 AND event == "a") AND date > 2017-1-1)")) != nullptr,
+           "Simplification works incorrectly #3");
+    Assert(dynamic_pointer_cast<EmptyNode>(parse("date < 2017-1-1 OR date >= 2016-1-1")) != nullptr,
+           "Simplification works incorrectly #4");
+    Assert(dynamic_pointer_cast<EmptyNode>(parse(R"(event != "a" OR event != "b")")) != nullptr,
+           "Simplification works incorrectly #5");
+    Assert(dynamic_pointer_cast<EmptyNode>(parse(R"(date <= 2017-1-1 OR (date > 2017-1-1 OR event == "a"))")) != nullptr,
+           "Simplification works incorrectly #6");
+
+    AssertEqual(operand_count(parse("date >= 2017-01-01 AND date >= 2017-06-01 OR date < 1900-01-01")), 2u,
+                "Simplification works incorrectly #7");
+    AssertEqual(operand_count(parse(R"(date > 2017-1-1 AND (event == "a" AND (date > 2017-2-1 AND event != "b")))")), 2u,
+                "Simplification works incorrectly #8");
+    AssertEqual(operand_count(parse(R"(event == "a" OR (event == "b" OR event == "a"))")), 2u,
+                "Simplification works incorrectly #9");
+
+    // the signal pill passes every event comparison, so these are not contradictions
+    const auto events = parse(R"(event == "a" AND event == "b")");
+    Assert(dynamic_pointer_cast<FalseNode>(events) == nullptr, "Simplification works incorrectly #10");
+    Assert(events->Evaluate(Date(2017, 1, 1), "{%signal%pill%}"), "Simplification works incorrectly #11");
+    Assert(!events->Evaluate(Date(2017, 1, 1), "a"), "Simplification works incorrectly #12");
+
+    Database db;
+    db.Add(Date(2017, 1, 1), "a");
+    AssertEqual(ExecuteCommands(db, {"Explain date > 2017-1-1 AND (date < 2016-1-1 OR date < 2015-1-1)"}),
+                "Plan: empty date range, evaluated per bucket\n"
+                "Estimated: 0 matching of 0 touched entries\n"
+                "Actual: 0 matching of 0 touched entries in 0 buckets\n",
+                "Simplification works incorrectly #13");
+}
+
+// Condition with a fixed answer which counts its evaluations and takes a while to evaluate
+struct CountingNode : public Node {
+    CountingNode(bool value, int cost) : value(value), cost(cost) {}
+
+    bool Evaluate(const Date &date, string_view event) const override {
+        evaluations++;
+
+        volatile int work = 0;
+        for (int i = 0; i < cost; ++i) {
+            work = work + i;
+        }
+        return value;
+    }
+
+    bool DependsOnEvent() const override {
+        return true;
+    }
+
+    double EstimateSelectivity(const Statistics &statistics) const override {
+        return value;
+    }
+
+    bool value;
+    int cost;
+    mutable int evaluations = 0;
+};
+
+void TestAdaptiveOrder() {
+    {
+        auto expensive = make_shared<CountingNode>(true, 2000);
+        auto cheap = make_shared<CountingNode>(false, 0);
+        LogicalOperationNode node(LogicalOperation::And, expensive, cheap);
+
+        for (int i = 0; i < 100000; ++i) {
+            Assert(!node.Evaluate(Date(2017, 1, 1), "event"), "Adaptive order works incorrectly #1#1");
+        }
+
+        AssertEqual(cheap->evaluations, 100000, "Adaptive order works incorrectly #1#2");
+        Assert(expensive->evaluations < 10000, "Adaptive order works incorrectly #1#3");
+    }
+
+    {
+        auto rarely_true = make_shared<CountingNode>(false, 0);
+        auto always_true = make_shared<CountingNode>(true, 0);
+        LogicalOperationNode node(LogicalOperation::Or, rarely_true, always_true);
+
+        EventBucket bucket;
+        for (int i = 0; i < 1000; ++i) {
+            bucket.Append("event " + to_string(i));
+        }
+
+        EventMask mask;
+        for (int i = 0; i < 100; ++i) {
+            node.EvaluateBucket(Date(2017, 1, 1), bucket, mask);
+            Assert(IsMaskFull(mask, bucket.Size()), "Adaptive order works incorrectly #2#1");
+        }
+
+        Assert(rarely_true->evaluations < 10000, "Adaptive order works incorrectly #2#2");
+    }
+}
+
+void TestExplain() {
+    Database db;
+
+    for (int month = 1; month <= 12; ++month) {
+        for (int day = 1; day <= 31; ++day) {
+            db.Add(Date(2017, month, day), "event");
+            db.Add(Date(2017, month, day), day % 2 ? "odd" : "even");
+        }
+    }
+
+    AssertEqual(db.GetStatistics().GetEventCount(), 744, "Statistics work incorrectly #1");
+    AssertEqual(db.GetStatistics().GetDistinctEventCount(), 3, "Statistics work incorrectly #2");
+    AssertEqual(db.GetStatistics().GetEventCount("odd"), 192, "Statistics work incorrectly #3");
+
+    const vector<pair<string, string>> expected = {
+            {"date >= 2017-3-1 AND date < 2017-4-1",
+                    "Plan: date range seek [2017-03-01, 2017-04-01), evaluated per bucket\n"
+                    "Estimated: 62 matching of 62 touched entries\n"
+                    "Actual: 62 matching of 0 touched entries in 31 buckets\n"},
+            {R"(event == "odd" AND date > 2017-12-30)",
+                    "Plan: date range seek (2017-12-30, +inf), evaluated per entry\n"
+                    "Estimated: 1 matching of 2 touched entries\n"
+                    "Actual: 1 matching of 2 touched entries in 1 buckets\n"},
+            {R"(event != "event")",
+                    "Plan: full scan, evaluated per entry\n"
+                    "Estimated: 372 matching of 744 touched entries\n"
+                    "Actual: 372 matching of 744 touched entries in 372 buckets\n"},
+            {"date > 2017-3-1 AND date < 2017-3-1",
+                    "Plan: empty date range, evaluated per bucket\n"
+                    "Estimated: 0 matching of 0 touched entries\n"
+                    "Actual: 0 matching of 0 touched entries in 0 buckets\n"},
+    };
+
+    for (const auto &item : expected) {
+        AssertEqual(ExecuteCommands(db, {"Explain " + item.first}), item.second,
+                    "Explain works incorrectly for: " + item.first);
+    }
+
+    std::stringstream stream(R"(event == "odd")");
+    db.RemoveIf(ParseCondition(stream));
+    AssertEqual(db.GetStatistics().GetEventCount(), 552, "Statistics work incorrectly #4");
+    AssertEqual(db.GetStatistics().GetEventCount("odd"), 0, "Statistics work incorrectly #5");
+
+    // whole buckets leave their events in the sketch, the rest keep their share
+    std::stringstream second_half("date >= 2017-7-1");
+    db.RemoveIf(ParseCondition(second_half));
+    AssertEqual(db.GetStatistics().GetEventCount(), 276, "Statistics work incorrectly #6");
+    AssertEqual(db.GetStatistics().GetEventCount("even"), 90, "Statistics work incorrectly #7");
+}
+
+void TestMemoryUsage() {
+    Database db;
+
+    const MemoryReport empty = db.MemoryUsage();
+    AssertEqual(empty.date_nodes, 0u, "Memory usage works incorrectly #1");
+    AssertEqual(empty.buckets.Total(), 0u, "Memory usage works incorrectly #2");
+
+    for (int day = 1; day <= 10; ++day) {
+        for (int i = 0; i < 1000; ++i) {
+            db.Add(Date(2017, 1, day), "a long enough event number " + to_string(i));
+        }
+    }
+
+    const MemoryReport full = db.MemoryUsage();
+    Assert(full.date_nodes > 0, "Memory usage works incorrectly #3");
+    Assert(full.buckets.data >= 10 * 1000 * 28, "Memory usage works incorrectly #4");
+    Assert(full.buckets.index >= 10 * 1000 * 8, "Memory usage works incorrectly #5");
+    Assert(full.statistics > 0 && full.statistics * 10 < full.buckets.data, "Memory usage works incorrectly #6");
+
+    std::stringstream half("date <= 2017-1-5");
+    db.RemoveIf(ParseCondition(half));
+    const MemoryReport after_half = db.MemoryUsage();
+    AssertEqual(after_half.date_nodes, full.date_nodes / 2, "Memory usage works incorrectly #7");
+    AssertEqual(after_half.buckets.Total(), full.buckets.Total() / 2, "Memory usage works incorrectly #8");
+
+    stringstream os;
+    ExecuteBatch(db, {ParseCommand(R"(Del event != "a long enough event number 7")")}, os);
+    Assert(db.MemoryUsage().buckets.Total() * 100 < after_half.buckets.Total(), "Memory usage works incorrectly #9");
+
+    std::stringstream rest("");
+    db.RemoveIf(ParseCondition(rest));
+    AssertEqual(db.MemoryUsage().date_nodes, 0u, "Memory usage works incorrectly #10");
+    AssertEqual(db.MemoryUsage().buckets.Total(), 0u, "Memory usage works incorrectly #11");
+
+    db.Add(Date(2017, 1, 1), "event");
+    const string output = ExecuteCommands(db, {"Memory"});
+    AssertEqual(output.substr(0, output.find('\n')),
+                "Memory: " + to_string(db.MemoryUsage().Total()) + " bytes",
+                "Memory command works incorrectly");
+}
+
+void TestCompression() {
+    Database plain;
+    Database compressed;
+
+    for (Database *db : {&plain, &compressed}) {
+        for (int i = 0; i < 2000; ++i) {
+            db->Add(Date(2017, 1, 1), "deploy service-" + to_string(i));
+        }
+    }
+
+    compressed.SetCompression(100);
+    for (Database *db : {&plain, &compressed}) {
+        for (int i = 0; i < 2048; ++i) {
+            db->Add(Date(2017, 1, 2), "rollback service-" + to_string(i));
+        }
+    }
+
+    const MemoryReport report = compressed.MemoryUsage();
+    Assert(report.buckets.packed > 0, "Compression works incorrectly #1");
+    Assert(report.buckets.packed * 2 < plain.MemoryUsage().buckets.data / 2, "Compression works incorrectly #2");
+
+    const vector<string> commands = {
+            "Find event >= \"deploy service-1999\"",
+            "Count date == 2017-1-1",
+            "Last 2017-1-1",
+            "Del event == \"deploy service-7\" OR event == \"rollback service-7\"",
+            "Add 2017-1-1 deploy service-0",
+            "Add 2017-1-1 deploy service-7",
+            "Print",
+    };
+    AssertEqual(ExecuteCommands(compressed, commands), ExecuteCommands(plain, commands),
+                "Compression works incorrectly #3");
+
+    // the write inflated the bucket
+    AssertEqual(compressed.MemoryUsage().buckets.packed, 0u, "Compression works incorrectly #4");
+
+    compressed.SetCompression(nullopt);
+    AssertEqual(compressed.MemoryUsage().buckets.packed, 0u, "Compression works incorrectly #5");
+    AssertEqual(ExecuteCommands(compressed, {"Print"}), ExecuteCommands(plain, {"Print"}),
+                "Compression works incorrectly #6");
+}
+
+// Entries of the directory other than . and ..
+int CountFiles(const string &path) {
+    DIR *directory = opendir(path.c_str());
+    if (!directory)
+        return -1;
+
+    int count = 0;
+    while (const dirent *entry = readdir(directory)) {
+        count += string(entry->d_name) != "." && string(entry->d_name) != "..";
+    }
+    closedir(directory);
+    return count;
+}
+
+void TestTieredStorage() {
+    char directory[] = "/tmp/database-test-XXXXXX";
+    Assert(mkdtemp(directory) != nullptr, "Tiered storage works incorrectly #0");
+
+    Database plain;
+    Database tiered;
+    tiered.SetMemoryBudget(64 * 1024, directory);
+
+    for (Database *db : {&plain, &tiered}) {
+        for (int day = 1; day <= 30; ++day) {
+            for (int i = 0; i < 100; ++i) {
+                db->Add(Date(2017, 1, day), "an event of some length " + to_string(i));
+            }
+        }
+    }
+
+    const MemoryReport report = tiered.MemoryUsage();
+    Assert(report.Total() <= 64 * 1024, "Tiered storage works incorrectly #1");
+    Assert(report.segments > 0, "Tiered storage works incorrectly #2");
+    Assert(report.buckets.Total() * 4 < plain.MemoryUsage().buckets.Total(), "Tiered storage works incorrectly #3");
+
+    const vector<string> commands = {
+            "Find date < 2017-1-3 AND event >= \"an event of some length 95\"",
+            "Count event == \"an event of some length 7\"",
+            "Exists date == 2017-1-2 AND event == \"an event of some length 99\"",
+            "Last 2017-1-5",
+            "Del date == 2017-1-4 OR event == \"an event of some length 3\"",
+            "Add 2017-1-1 an event written again",
+            "Add 2017-1-2 an event of some length 3",
+            "Print",
+            "Retention floor 2017-1-2",
+            "Expire",
+            "Print",
+    };
+    AssertEqual(ExecuteCommands(tiered, commands), ExecuteCommands(plain, commands),
+                "Tiered storage works incorrectly #4");
+
+    // every write to an old date pages its bucket in, and spilling it again merges it
+    // into the segments around it instead of adding a file each time
+    for (int i = 0; i < 200; ++i) {
+        const vector<string> write = {
+                "Add 2017-1-" + to_string(2 + i % 20) + " written again " + to_string(i),
+                "Exists date == 2017-1-2",
+        };
+        AssertEqual(ExecuteCommands(tiered, write), ExecuteCommands(plain, write),
+                    "Tiered storage works incorrectly #7");
+    }
+    const int files = CountFiles(directory);
+    Assert(files > 0 && files <= 10, "Tiered storage works incorrectly #8");
+    AssertEqual(ExecuteCommands(tiered, {"Print"}), ExecuteCommands(plain, {"Print"}),
+                "Tiered storage works incorrectly #9");
+
+    tiered.SetMemoryBudget(nullopt, "");
+    AssertEqual(tiered.MemoryUsage().segments, 0u, "Tiered storage works incorrectly #5");
+    AssertEqual(ExecuteCommands(tiered, {"Print"}), ExecuteCommands(plain, {"Print"}),
+                "Tiered storage works incorrectly #6");
+    AssertEqual(rmdir(directory), 0, "Tiered storage works incorrectly #10");
+}
+
+void TestWriteBuffer() {
+    Database buffered;
+    Database merged;
+
+    // merged inserts every Add on its own
+    mt19937 random(7);
+    for (int i = 0; i < 10000; ++i) {
+        const Date date(2017, 1 + random() % 3, 1 + random() % 28);
+        const string event = "event " + to_string(random() % 500);
+
+        buffered.AddBuffered(date, event);
+        merged.Add(date, event);
+    }
+
+    // reads do not merge, they see what the buffer held when it last filled up
+    Assert(buffered.HasBufferedAdds(), "Write buffer works incorrectly #4");
+    Assert(buffered.GetHistoryEventSize() < merged.GetHistoryEventSize(), "Write buffer works incorrectly #5");
+    buffered.Flush();
+    Assert(!buffered.HasBufferedAdds(), "Write buffer works incorrectly #6");
+
+    AssertEqual(buffered.GetHistoryEventSize(), merged.GetHistoryEventSize(), "Write buffer works incorrectly #1");
+    AssertEqual(buffered.GetStatistics().GetEventCount(), merged.GetHistoryEventSize(),
+                "Write buffer works incorrectly #2");
+
+    const vector<string> commands = {
+            "Print",
+            "Last 2017-2-15",
+            "Add 2017-3-1 event 1",
+            "Add 2017-3-1 a new event",
+            "Count event == \"event 1\"",
+            "Retention age 20 auto",
+            "Add 2017-1-1 too old",
+            "Add 2017-4-1 newest",
+            "Add 2017-3-20 kept",
+            "Print",
+    };
+    AssertEqual(ExecuteCommands(buffered, commands), ExecuteCommands(merged, commands),
+                "Write buffer works incorrectly #3");
+}
+
+void TestVersions() {
+    {
+        Database db;
+        db.SetVersionLimit(2);
+
+        const string output = ExecuteCommands(db, {
+                "Add 2017-1-1 a",
+                "Add 2017-1-1 b",
+                "Add 2017-1-2 c",
+                "Del event == \"a\"",
+                "Add 2017-1-3 d",
+                "Del date == 2017-1-2",
+                "Version",
+                "Find AS OF 0",
+                "Find AS OF 1 date >= 2017-1-2",
+                "Find AS OF 2",
+                "Last AS OF 0 2017-1-5",
+                "Last AS OF 1 2017-1-2",
+                "Expire",
+                "Find AS OF 0",
+                "Last AS OF 3 2016-12-31",
+        });
+        const string expected = "Removed 1 entries\n"
+                                "Removed 1 entries\n"
+                                "Version 2\n"
+                                "2017-01-01 a\n2017-01-01 b\n2017-01-02 c\nFound 3 entries\n"
+                                "2017-01-02 c\n2017-01-03 d\nFound 2 entries\n"
+                                "2017-01-01 b\n2017-01-03 d\nFound 2 entries\n"
+                                "2017-01-02 c\n"
+                                "2017-01-02 c\n"
+                                "Removed 0 entries\n"
+                                "Unknown version 0\n"
+                                "No entries\n";
+        AssertEqual(output, expected, "Versions work incorrectly #1");
+        Assert(db.MemoryUsage().versions > 0, "Versions work incorrectly #2");
+
+        db.SetVersionLimit(0);
+        AssertEqual(db.MemoryUsage().versions, 0u, "Versions work incorrectly #3");
+        Assert(!db.HasVersion(2) && db.HasVersion(3), "Versions work incorrectly #4");
+    }
+    {
+        // Del commands of a batch start their versions as they do one by one
+        const vector<string> lines = {
+                "Del event == \"event 1\"",
+                "Find event >= \"event 5\"",
+                "Del date == 2017-1-2 OR event == \"event 2\"",
+                "Del event == \"event 3\"",
+        };
+
+        Database sequential;
+        Database batched;
+        vector<Command> commands;
+        for (Database *db : {&sequential, &batched}) {
+            db->SetVersionLimit(10);
+            for (int i = 0; i < 100; ++i) {
+                db->Add(Date(2017, 1, 1 + i % 3), "event " + to_string(i % 7));
+            }
+        }
+        for (const string &line : lines) {
+            commands.push_back(ParseCommand(line));
+        }
+
+        stringstream batch_output;
+        ExecuteBatch(batched, commands, batch_output);
+        AssertEqual(batch_output.str(), ExecuteCommands(sequential, lines), "Versions work incorrectly #5");
+
+        for (int version = 0; version <= 3; ++version) {
+            const vector<string> queries = {"Find AS OF " + to_string(version), "Last AS OF " + to_string(version) + " 2017-1-2"};
+            AssertEqual(ExecuteCommands(batched, queries), ExecuteCommands(sequential, queries),
+                        "Versions work incorrectly #6");
+        }
+    }
+    {
+        // every kept version reads as the state it closed, in both orders and page by page
+        Database db;
+        db.SetVersionLimit(4);
+        for (int i = 0; i < 60; ++i) {
+            db.Add(Date(2017, 1, 1 + i % 6), "event " + to_string(i % 5));
+        }
+
+        const auto all = ParseCommand("Find").condition;
+        const auto some = ParseCommand(R"(Find event != "event 0")").condition;
+
+        vector<vector<pair<Date, string>>> states;
+        vector<string> lasts;
+        const vector<string> deletions = {"date == 2017-1-2", "event == \"event 3\"", "date >= 2017-1-5",
+                                          "date == 2017-1-1 AND event == \"event 1\""};
+        for (const string &deletion : deletions) {
+            states.push_back(db.FindIf(all));
+            lasts.push_back(db.Last(Date(2017, 1, 5), some));
+            db.RemoveIf(ParseCommand("Del " + deletion).condition);
+            db.Add(Date(2017, 1, 4), "added " + deletion);
+        }
+
+        for (uint64_t version = 0; version < states.size(); ++version) {
+            Assert(db.FindIf(all, version) == states[version], "Versions work incorrectly #7");
+            AssertEqual(db.Last(Date(2017, 1, 5), some, version), lasts[version], "Versions work incorrectly #8");
+
+            FindOptions descending;
+            descending.descending = true;
+            auto reversed = states[version];
+            reverse(reversed.begin(), reversed.end());
+            Assert(db.FindIf(all, version, descending).entries == reversed, "Versions work incorrectly #9");
+
+            FindOptions page;
+            page.limit = 7;
+            vector<pair<Date, string>> pages;
+            for (FindResult result = db.FindIf(all, version, page);; result = db.FindIf(all, version, page)) {
+                pages.insert(pages.end(), result.entries.begin(), result.entries.end());
+                if (!result.cursor)
+                    break;
+                page.after = result.cursor;
+            }
+            auto ordered = states[version];
+            sort(ordered.begin(), ordered.end());
+            Assert(pages == ordered, "Versions work incorrectly #10");
+        }
+
+        db.SetVersionLimit(1);
+        bool thrown = false;
+        try {
+            db.Last(Date(2017, 1, 5), 0);
+        } catch (out_of_range &) {
+            thrown = true;
+        }
+        Assert(thrown, "Versions work incorrectly #11");
+    }
+}
+
+void TestSubscriptions() {
+    {
+        Database db;
+        db.Add(Date(2017, 1, 1), "a");
+
+        const string output = ExecuteCommands(db, {
+                "Subscribe event == \"a\"",
+                "Subscribe date >= 2017-1-2",
+                "Add 2017-1-1 a",
+                "Add 2017-1-2 a",
+                "Add 2017-1-3 b",
+                "Del event == \"b\"",
+                "Poll 1",
+                "Poll 2",
+                "Poll 2",
+                "Unsubscribe 1",
+                "Poll 1",
+                "Del",
+                "Poll 2",
+        });
+        const string expected = "Subscription 1\n"
+                                "Subscription 2\n"
+                                "Removed 1 entries\n"
+                                "+ 2017-01-02 a\nFound 1 changes\n"
+                                "+ 2017-01-02 a\n+ 2017-01-03 b\n- 2017-01-03 b\nFound 3 changes\n"
+                                "Found 0 changes\n"
+                                "Unknown subscription 1\n"
+                                "Removed 2 entries\n"
+                                "- 2017-01-02 a\nFound 1 changes\n";
+        AssertEqual(output, expected, "Subscriptions work incorrectly #1");
+    }
+    {
+        // deltas of the index are the entries matching the condition among all changes
+        const vector<string> conditions = {
+                "",
+                R"(event == "event 3")",
+                R"(event == "event 3" OR event == "event 5")",
+                R"(event > "event 4" AND date < 2017-1-4)",
+                "date >= 2017-1-3",
+                R"(date == 2017-1-2 AND event != "event 1")",
+                R"(event == "event 1" AND event == "event 2")",
+                "date > 2017-1-5 AND date < 2017-1-1",
+        };
+
+        Database db;
+        db.SetRetentionPolicy({4, nullopt, true});
+
+        vector<shared_ptr<Node>> nodes;
+        for (const string &condition : conditions) {
+            istringstream is(condition);
+            nodes.push_back(ParseCondition(is));
+            db.Subscribe(nodes.back());
+        }
+
+        vector<pair<Date, string>> added;
+        for (int i = 0; i < 300; ++i) {
+            const Date date(2017, 1, 1 + i % 7 + i / 100);
+            const string event = i % 50 == 0 ? "{%signal%pill%}" : "event " + to_string(i % 9);
+            if (db.FindIf([&](const Date &d, string_view e) { return d == date && e == event; }).empty())
+                added.emplace_back(date, event);
+            db.Add(date, event);
+        }
+        db.RemoveIf(ParseCommand(R"(Del event == "event 7")").condition);
+        const vector<pair<Date, string>> left = db.FindIf([](const Date &, string_view) { return true; });
+
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            int expected_added = 0;
+            for (const auto &entry : added) {
+                expected_added += nodes[i]->Evaluate(entry.first, entry.second);
+            }
+            int expected_removed = expected_added;
+            for (const auto &entry : left) {
+                expected_removed -= nodes[i]->Evaluate(entry.first, entry.second);
+            }
+
+            int actual_added = 0;
+            int actual_removed = 0;
+            const vector<SubscriptionDelta> deltas = *db.TakeDeltas(i + 1);
+            for (const SubscriptionDelta &delta : deltas) {
+                Assert(nodes[i]->Evaluate(delta.date, delta.event), "Subscriptions work incorrectly #2");
+                (delta.added ? actual_added : actual_removed)++;
+            }
+
+            AssertEqual(actual_added, expected_added, "Subscriptions work incorrectly #3 for: " + conditions[i]);
+            AssertEqual(actual_removed, expected_removed, "Subscriptions work incorrectly #4 for: " + conditions[i]);
+        }
+        Assert(db.MemoryUsage().subscriptions > 0, "Subscriptions work incorrectly #5");
+
+        // the running count goes back to nothing with queued deltas dropped unread
+        db.Add(Date(2017, 1, 5), "event 3 which is long enough to leave the small string buffer");
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            db.Unsubscribe(i + 1);
+        }
+        AssertEqual(db.MemoryUsage().subscriptions, 0u, "Subscriptions work incorrectly #6");
+    }
+}
+
+void TestViews() {
+    {
+        Database db;
+        db.Add(Date(2017, 1, 1), "a");
+        db.Add(Date(2017, 1, 2), "b");
+        db.Add(Date(2017, 1, 2), "a");
+
+        const string output = ExecuteCommands(db, {
+                "CreateView event == \"a\"",
+                "CreateView date > 2017-1-5",
+                "View 1",
+                "View 2",
+                "Add 2017-1-1 c",
+                "Add 2017-1-1 a",
+                "Add 2017-1-6 x",
+                "View 1",
+                "View 2",
+                "Del date == 2017-1-2",
+                "View 1",
+                "Del",
+                "View 1",
+                "DropView 1",
+                "View 1",
+                "Poll 2",
+        });
+        const string expected = "View 1\n"
+                                "View 2\n"
+                                "Found 2 entries\n2017-01-02 a\n"
+                                "Found 0 entries\nNo entries\n"
+                                "Found 2 entries\n2017-01-02 a\n"
+                                "Found 1 entries\n2017-01-06 x\n"
+                                "Removed 2 entries\n"
+                                "Found 1 entries\n2017-01-01 a\n"
+                                "Removed 3 entries\n"
+                                "Found 0 entries\nNo entries\n"
+                                "Unknown view 1\n"
+                                "Unknown subscription 2\n";
+        AssertEqual(output, expected, "Views work incorrectly #1");
+    }
+    {
+        // a view reads the same as a count and the last entry found for its condition
+        const vector<string> conditions = {
+                "",
+                R"(event == "event 3")",
+                R"(event < "event 4" AND date != 2017-1-3)",
+                "date <= 2017-1-5",
+                R"(event == "event 1" AND event == "event 2")",
+        };
+
+        Database db;
+        db.SetRetentionPolicy({5, nullopt, true});
+
+        vector<shared_ptr<Node>> nodes;
+        for (int i = 0; i < 100; ++i) {
+            db.Add(Date(2017, 1, 1 + i % 4), "event " + to_string(i % 9));
+        }
+        for (const string &condition : conditions) {
+            nodes.push_back(ParseCommand("Find " + condition).condition);
+            db.CreateView(nodes.back());
+        }
+
+        for (int i = 0; i < 300; ++i) {
+            db.Add(Date(2017, 1, 1 + i % 7 + i / 60), i % 40 == 0 ? "{%signal%pill%}" : "event " + to_string(i * 7 % 11));
+            if (i % 25 == 0)
+                db.RemoveIf(ParseCommand("Del event == \"event " + to_string(i % 11) + "\"").condition);
+
+            for (size_t j = 0; j < nodes.size(); ++j) {
+                const auto entries = db.FindIf(nodes[j]);
+                const ViewResult view = *db.ReadView(j + 1);
+
+                AssertEqual(view.count, static_cast<int>(entries.size()), "Views work incorrectly #2 for: " + conditions[j]);
+                Assert(entries.empty() ? !view.latest : view.latest == entries.back(),
+                       "Views work incorrectly #3 for: " + conditions[j]);
+            }
+        }
+
+        // latest entries past the small string buffer are counted as well
+        const string long_event(40, 'x');
+        db.Add(Date(2017, 1, 20), long_event);
+        db.Add(Date(2017, 1, 20), long_event + "y");
+        db.RemoveIf(ParseCommand("Del event == \"" + long_event + "y\"").condition);
+        Assert(db.ReadView(1)->latest == make_pair(Date(2017, 1, 20), long_event), "Views work incorrectly #4");
+
+        Assert(db.MemoryUsage().subscriptions > 0, "Views work incorrectly #5");
+        for (size_t j = 0; j < nodes.size(); ++j) {
+            db.DropView(j + 1);
+        }
+        AssertEqual(db.MemoryUsage().subscriptions, 0u, "Views work incorrectly #6");
+    }
+    {
+        // a newest date without a match leaves the latest entry to the dates before it
+        SubscriptionIndex index;
+        const uint64_t id = index.CreateView(ParseCommand(R"(Find event == "a")").condition,
+                                             ViewResult{3, make_pair(Date(2017, 1, 2), string("a"))},
+                                             {{Date(2017, 1, 1), 1}, {Date(2017, 1, 2), 2}});
+
+        index.Publish(false, Date(2017, 1, 2), "a");
+        index.RefreshViews([](const Date &date, const Node &) -> optional<string> {
+            if (date == Date(2017, 1, 2))
+                return nullopt;
+            return "a";
+        });
+        Assert(index.ReadView(id)->latest == make_pair(Date(2017, 1, 1), string("a")), "Views work incorrectly #7");
+
+        index.Publish(false, Date(2017, 1, 1), "a");
+        index.RefreshViews([](const Date &, const Node &) -> optional<string> { return nullopt; });
+        Assert(!index.ReadView(id)->latest, "Views work incorrectly #8");
+    }
+}
+
+void TestExpire() {
+    {
+        Database db;
+
+        db.Add(Date(2017, 1, 1), "new year");
+        db.Add(Date(2017, 1, 1), "holiday");
+        db.Add(Date(2017, 2, 28), "winter");
+        db.Add(Date(2017, 3, 1), "spring");
+
+        RetentionPolicy policy;
+        policy.max_age_days = 1;
+        db.SetRetentionPolicy(policy);
+
+        AssertEqual(db.Expire(), 2, "Expire works incorrectly #1#1");
+        AssertEqual(db.Last(Date(2017, 2, 28)), "2017-02-28 winter", "Expire works incorrectly #1#2");
+        AssertEqual(db.Expire(), 0, "Expire works incorrectly #1#3");
+    }
+
+    {
+        Database db;
+
+        RetentionPolicy policy;
+        policy.floor = Date(2016, 12, 31);
+        policy.automatic = true;
+        db.SetRetentionPolicy(policy);
+
+        db.Add(Date(2016, 12, 30), "old");
+        db.Add(Date(2016, 12, 31), "eve");
+        db.Add(Date(2017, 1, 1), "new year");
+
+        AssertEqual(db.GetHistoryEventSize(), 2, "Expire works incorrectly #2#1");
+        AssertEqual(db.GetStorageSize(), 2, "Expire works incorrectly #2#2");
+    }
+
+    {
+        AssertEqual(DateToDays(Date(1970, 1, 1)), 0, "Date to days works incorrectly #1");
+        AssertEqual(DateToDays(Date(2000, 3, 1)) - DateToDays(Date(2000, 2, 28)), 2,
+                    "Date to days works incorrectly #2");
+        AssertEqual(DaysToDate(DateToDays(Date(1600, 2, 29))).ToString(), "1600-2-29",
+                    "Days to date works incorrectly");
+    }
 }
 
 void TestPrint() {
@@ -762,14 +1729,531 @@ void TestPrint() {
                 "Print works incorrectly #3"
         );
     }
+
+    {
+        Database db;
+
+        db.Add(Date(10000, 1, 1), "far future");
+        db.Add(Date(-1, 1, 1), "far past");
+        db.Add(Date(15, 3, 8), "ides of march");
+        db.Add(Date(2017, 11, 30), "today");
+
+        stringstream stream;
+
+        db.Print(stream);
+
+        AssertEqual(
+                stream.str(),
+                "00-1-01-01 far past\n0015-03-08 ides of march\n2017-11-30 today\n10000-01-01 far future\n",
+                "Print works incorrectly #4"
+        );
+    }
+
+    {
+        Database db;
+        stringstream expected;
+
+        for (int day = 1; day <= 3; ++day) {
+            for (int i = 0; i < 3000; ++i) {
+                db.Add(Date(2000, 1, day), "event number " + to_string(i));
+                expected << Date(2000, 1, day) << " event number " << i << endl;
+            }
+        }
+
+        stringstream stream;
+
+        db.Print(stream);
+
+        AssertEqual(stream.str(), expected.str(), "Print works incorrectly #5");
+    }
+}
+
+void TestEventBucket() {
+    {
+        EventBucket bucket;
+
+        bucket.Append("tennis");
+        bucket.Append("");
+        bucket.Append("a much longer event which does not fit into small string buffer");
+
+        AssertEqual(bucket.Size(), 3u, "Event bucket works incorrectly #1#1");
+        AssertEqual(string(bucket.At(0)), "tennis", "Event bucket works incorrectly #1#2");
+        AssertEqual(string(bucket.At(1)), "", "Event bucket works incorrectly #1#3");
+        AssertEqual(string(bucket.Back()),
+                    "a much longer event which does not fit into small string buffer",
+                    "Event bucket works incorrectly #1#4");
+    }
+
+    {
+        EventBucket bucket;
+
+        bucket.Append("tennis");
+        bucket.Append("football");
+        bucket.Append("baseball");
+        bucket.Append("handball");
+
+        auto removed = bucket.RemoveIf([](string_view event) {
+            return event.find("ball") != string_view::npos && event != "baseball";
+        });
+
+        vector<string> events;
+        for (string_view event : bucket) {
+            events.emplace_back(event);
+        }
+
+        AssertEqual(removed, 2u, "Event bucket works incorrectly #2#1");
+        AssertEqual(events, vector<string>{"tennis", "baseball"}, "Event bucket works incorrectly #2#2");
+
+        bucket.Append("chess");
+        AssertEqual(string(bucket.Back()), "chess", "Event bucket works incorrectly #2#3");
+    }
+
+    {
+        EventBucket bucket;
+
+        for (int i = 0; i < 1000; ++i) {
+            Assert(bucket.Insert("event " + to_string(i)), "Event bucket works incorrectly #3#1");
+        }
+        for (int i = 0; i < 1000; ++i) {
+            Assert(!bucket.Insert("event " + to_string(i)), "Event bucket works incorrectly #3#2");
+        }
+        AssertEqual(bucket.Size(), 1000u, "Event bucket works incorrectly #3#3");
+
+        bucket.RemoveIf([](string_view event) {
+            return event.back() % 2 == 0;
+        });
+        AssertEqual(bucket.Size(), 500u, "Event bucket works incorrectly #3#4");
+        Assert(!bucket.Contains("event 998"), "Event bucket works incorrectly #3#5");
+        Assert(bucket.Contains("event 999"), "Event bucket works incorrectly #3#6");
+        Assert(bucket.Insert("event 998"), "Event bucket works incorrectly #3#7");
+        Assert(!bucket.Insert("event 997"), "Event bucket works incorrectly #3#8");
+        AssertEqual(string(bucket.Back()), "event 998", "Event bucket works incorrectly #3#9");
+    }
+}
+
+void TestEventKernels() {
+    mt19937 generator(42);
+    const vector<string> values = {"", "a", "deploy", "deploy s", "deploy service-a", "deploy service-b",
+                                   "deploy service-aa", "zzzzzzzzzz", string("ab\0", 3), "\xff\xfe"};
+
+    EventBucket bucket;
+    for (int i = 0; i < 1000; ++i) {
+        string event = values[generator() % values.size()];
+        if (generator() % 3 == 0) {
+            event.push_back(static_cast<char>('a' + generator() % 3));
+        }
+        bucket.Append(event);
+    }
+
+    const vector<Comparison> comparisons = {Comparison::Less, Comparison::LessOrEqual, Comparison::Greater,
+                                            Comparison::GreaterOrEqual, Comparison::Equal, Comparison::NotEqual};
+
+    for (KernelLevel level : {KernelLevel::Scalar, KernelLevel::Sse2, KernelLevel::Avx2}) {
+        for (Comparison comparison : comparisons) {
+            for (const string &value : values) {
+                EventMask mask;
+                CompareEvents(bucket, comparison, value, mask, level);
+
+                EventMask expected;
+                EventComparisonNode(comparison, value).Node::EvaluateBucket(Date(2000, 1, 1), bucket, expected);
+
+                AssertEqual(mask, expected, "Event kernels work incorrectly for value " + value);
+            }
+        }
+    }
+
+    {
+        Database db;
+
+        db.Add(Date(1992, 12, 1), "tennis");
+        db.Add(Date(1992, 12, 1), "football");
+        db.Add(Date(1992, 12, 2), "{%signal%pill%}");
+        db.Add(Date(1992, 12, 10), "handball");
+
+        std::stringstream stream(R"(event > "football" AND event < "tennis")");
+        shared_ptr<Node> condition = ParseCondition(stream);
+
+        auto result = db.FindIf(condition);
+        AssertEqual(result.size(), 2u, "Find if with condition works incorrectly #1#1");
+        AssertEqual(result[0].second, "{%signal%pill%}", "Find if with condition works incorrectly #1#2");
+        AssertEqual(result[1].second, "handball", "Find if with condition works incorrectly #1#3");
+    }
+}
+
+void TestVectorizedConditions() {
+    const vector<string> conditions = {
+            "",
+            R"(date > 1992-12-1)",
+            R"(date == 1992-12-1 OR event == "handball")",
+            R"(event != "tennis" AND (date < 1992-12-10 OR event >= "h"))",
+            R"((event == "a" OR event == "b") AND date != 1992-12-2)",
+            R"(event < "football" OR date >= 1992-12-10)",
+    };
+
+    for (const string &text : conditions) {
+        Database db;
+        Database expected_db;
+
+        for (Database *target : {&db, &expected_db}) {
+            for (int i = 0; i < 150; ++i) {
+                const Date date(1992, 12, 1 + i % 11);
+                target->Add(date, vector<string>{"tennis", "football", "a", "b", "handball"}[i % 5]);
+                target->Add(date, "event " + to_string(i % 70));
+            }
+        }
+
+        std::stringstream stream(text);
+        shared_ptr<Node> condition = ParseCondition(stream);
+        auto predicate = [condition](const Date &date, string_view event) {
+            return condition->Evaluate(date, event);
+        };
+
+        Assert(db.FindIf(condition) == expected_db.FindIf(predicate),
+               "Vectorized find works incorrectly for: " + text);
+        AssertEqual(db.RemoveIf(condition), expected_db.RemoveIf(predicate),
+                    "Vectorized remove works incorrectly for: " + text);
+
+        stringstream output, expected_output;
+        db.Print(output);
+        expected_db.Print(expected_output);
+        AssertEqual(output.str(), expected_output.str(), "Vectorized remove works incorrectly for: " + text);
+        AssertEqual(db.GetStorageEventSize(), expected_db.GetStorageEventSize(),
+                    "Vectorized remove works incorrectly for: " + text);
+    }
+}
+
+void TestExecuteCommand() {
+    {
+        Database db;
+
+        const string output = ExecuteCommands(db, {
+                "Add 2017-01-01 Holiday",
+                "Add 2017-03-08 Holiday",
+                "Add 2017-1-1 New Year",
+                "Add 2017-1-1 New Year",
+                "",
+                "Print",
+                "Count event != \"working day\"",
+                "Exists event == \"working day\"",
+                "Del date > 2017-01-01",
+                "Find",
+                "Last 2016-12-31",
+        });
+
+        AssertEqual(output,
+                    "2017-01-01 Holiday\n2017-01-01 New Year\n2017-03-08 Holiday\n"
+                    "Found 3 entries\n"
+                    "No entries\n"
+                    "Removed 1 entries\n"
+                    "2017-01-01 Holiday\n2017-01-01 New Year\nFound 2 entries\n"
+                    "No entries\n",
+                    "Execute command works incorrectly #1");
+    }
+
+    {
+        bool thrown = false;
+        try {
+            ParseCommand("Drop date > 2017-01-01");
+        } catch (logic_error &) {
+            thrown = true;
+        }
+        Assert(thrown, "Parse command works incorrectly #2");
+    }
+
+    {
+        Assert(IsReadOnlyCommand(ParseCommand("Find event == \"a\"")), "Read only command works incorrectly #3#1");
+        Assert(!IsReadOnlyCommand(ParseCommand("  Del")), "Read only command works incorrectly #3#2");
+        Assert(!IsReadOnlyCommand(ParseCommand("Add 2017-1-1 a")), "Read only command works incorrectly #3#3");
+    }
+
+    {
+        Command command;
+        AssertEqual(int(TryParseCommand("Add +2017- 1-01   New  Year", command)), int(ParseStatus::Ok),
+                    "Try parse command works incorrectly #4#1");
+        AssertEqual(*command.date, Date(2017, 1, 1), "Try parse command works incorrectly #4#2");
+        AssertEqual(command.event, "New  Year", "Try parse command works incorrectly #4#3");
+
+        AssertEqual(int(TryParseCommand("Add 2017-13-01 event", command)), int(ParseStatus::WrongDate),
+                    "Try parse command works incorrectly #4#4");
+        AssertEqual(int(TryParseCommand("Last 2017/01/01", command)), int(ParseStatus::WrongDate),
+                    "Try parse command works incorrectly #4#5");
+        AssertEqual(int(TryParseCommand("Last AS OF 2 2017-1-1", command)), int(ParseStatus::Ok),
+                    "Try parse command works incorrectly #4#10");
+        AssertEqual(*command.version, 2u, "Try parse command works incorrectly #4#11");
+        AssertEqual(int(TryParseCommand("Find AS OF -1", command)), int(ParseStatus::WrongArguments),
+                    "Try parse command works incorrectly #4#12");
+        AssertEqual(int(TryParseCommand("Last 2017-1-1 event == \"a\"", command)), int(ParseStatus::Ok),
+                    "Try parse command works incorrectly #4#13");
+        Assert(command.type == CommandType::Last && command.condition, "Try parse command works incorrectly #4#14");
+        AssertEqual(int(TryParseCommand("Find LIMIT -1", command)), int(ParseStatus::WrongArguments),
+                    "Try parse command works incorrectly #4#15");
+        AssertEqual(int(TryParseCommand("Find AFTER 2017-1-1/x LIMIT 5", command)), int(ParseStatus::WrongArguments),
+                    "Try parse command works incorrectly #4#16");
+        AssertEqual(int(TryParseCommand("Drop", command)), int(ParseStatus::UnknownCommand),
+                    "Try parse command works incorrectly #4#6");
+        AssertEqual(int(TryParseCommand("Find date >", command)), int(ParseStatus::WrongArguments),
+                    "Try parse command works incorrectly #4#7");
+        AssertEqual(int(TryParseCommand("  ", command)), int(ParseStatus::Ok),
+                    "Try parse command works incorrectly #4#8");
+        Assert(command.type == CommandType::Empty, "Try parse command works incorrectly #4#9");
+    }
+}
+
+void TestPipeline() {
+    mt19937 generator(7);
+
+    stringstream input;
+    for (int i = 0; i < 30000; ++i) {
+        const int kind = generator() % 100;
+        if (kind < 90) {
+            input << "Add 2017-" << 1 + generator() % 12 << "-" << 1 + generator() % 28
+                  << " event " << generator() % 1000 << "\n";
+        } else if (kind < 94) {
+            input << "Del event == \"event " << generator() % 1000 << "\"\n";
+        } else if (kind < 98) {
+            input << "Find date == 2017-" << 1 + generator() % 12 << "-" << 1 + generator() % 28 << "\n";
+        } else if (kind < 99) {
+            input << "Last 2017-" << 1 + generator() % 12 << "-1\n";
+        } else {
+            input << "Add 2017-13-1 bad line\n";
+        }
+    }
+    input << "Count";
+
+    for (bool batch : {false, true}) {
+        IngestOptions options;
+        options.batch = batch;
+        options.skip_bad_lines = true;
+
+        Database sequential_db;
+        stringstream sequential_input(input.str());
+        stringstream sequential_output;
+        const size_t sequential_bad = RunCommands(sequential_db, sequential_input, sequential_output, options);
+
+        options.parser_count = 3;
+        Database pipeline_db;
+        stringstream pipeline_input(input.str());
+        stringstream pipeline_output;
+        const size_t pipeline_bad = RunCommands(pipeline_db, pipeline_input, pipeline_output, options);
+
+        Assert(sequential_bad > 0, "Pipeline works incorrectly #1");
+        AssertEqual(pipeline_bad, sequential_bad, "Pipeline works incorrectly #2");
+        Assert(pipeline_output.str() == sequential_output.str(), "Pipeline works incorrectly #3");
+    }
+
+    {
+        IngestOptions options;
+        options.parser_count = 2;
+
+        Database db;
+        stringstream pipeline_input("Add 2017-1-1 a\nPrint\nAdd 2017-1-32 b\nPrint\n");
+        stringstream pipeline_output;
+
+        bool thrown = false;
+        try {
+            RunCommands(db, pipeline_input, pipeline_output, options);
+        } catch (logic_error &) {
+            thrown = true;
+        }
+        Assert(thrown, "Pipeline works incorrectly #4");
+        AssertEqual(pipeline_output.str(), "2017-01-01 a\n", "Pipeline works incorrectly #5");
+    }
+}
+
+// Connects to the server, retrying until it listens, -1 if it never does
+int ConnectToServer(const string &socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    socket_path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+    for (int attempt = 0; attempt < 1000; ++attempt) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return -1;
+}
+
+void SendToServer(int fd, const string &lines) {
+    for (size_t sent = 0; sent < lines.size();) {
+        const ssize_t size = send(fd, lines.data() + sent, lines.size() - sent, MSG_NOSIGNAL);
+        if (size <= 0)
+            return;
+        sent += size;
+    }
+}
+
+// Reads replies until line_count lines have come, or until the server closes the connection
+string ReceiveFromServer(int fd, size_t line_count = SIZE_MAX) {
+    string reply;
+    char buffer[1 << 12];
+    while (static_cast<size_t>(count(reply.begin(), reply.end(), '\n')) < line_count) {
+        const ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+        if (size <= 0)
+            break;
+        reply.append(buffer, size);
+    }
+    return reply;
+}
+
+// Sends the lines and waits for line_count lines of replies
+string ExchangeWithServer(int fd, const string &lines, size_t line_count) {
+    SendToServer(fd, lines);
+    return ReceiveFromServer(fd, line_count);
+}
+
+void TestServer() {
+    char directory[] = "/tmp/database-test-XXXXXX";
+    Assert(mkdtemp(directory) != nullptr, "Server works incorrectly #0#1");
+    const string socket_path = string(directory) + "/server.sock";
+
+    int stop[2];
+    Assert(pipe(stop) == 0, "Server works incorrectly #0#2");
+
+    Database db;
+    thread server([&] { RunServer(db, socket_path, 4, stop[0]); });
+
+    // every client pipelines its whole stream of writes, reads and bad lines at once,
+    // so commands of all clients are interleaved by the server
+    const int client_count = 4;
+    const int step_count = 300;
+    vector<string> replies(client_count);
+    vector<thread> clients;
+
+    for (int client = 0; client < client_count; ++client) {
+        clients.emplace_back([&, client] {
+            const string date = "2017-1-" + to_string(client + 1);
+
+            string lines;
+            for (int step = 0; step < step_count; ++step) {
+                lines += "Add " + date + " event " + to_string(step) + "\n";
+                if (step % 3 == 2)
+                    lines += "Del date == " + date + " AND event == \"event " + to_string(step - 1) + "\"\n";
+                lines += "Last " + date + "\n";
+                if (step % 100 == 0)
+                    lines += "Add 2017-13-1 bad\n";
+            }
+
+            const int fd = ConnectToServer(socket_path);
+            SendToServer(fd, lines);
+            shutdown(fd, SHUT_WR);
+            replies[client] = ReceiveFromServer(fd);
+            close(fd);
+        });
+    }
+    for (auto &client : clients) {
+        client.join();
+    }
+
+    // writes of different connections are applied in the order they arrived
+    const int first = ConnectToServer(socket_path);
+    const int second = ConnectToServer(socket_path);
+    const vector<string> ordered_replies = {
+            ExchangeWithServer(first, "Add 2017-2-1 a\nCount date == 2017-2-1\n", 1),
+            ExchangeWithServer(second, "Del date == 2017-2-1\nAdd 2017-2-1 b\nCount date == 2017-2-1\n", 2),
+            ExchangeWithServer(first, "Add 2017-2-1 a\nFind date == 2017-2-1\n", 3),
+    };
+    close(first);
+    close(second);
+
+    const ssize_t stopped = write(stop[1], "\n", 1);
+    server.join();
+    close(stop[0]);
+    close(stop[1]);
+
+    for (int client = 0; client < client_count; ++client) {
+        const string date = "2017-01-0" + to_string(client + 1);
+
+        string expected;
+        for (int step = 0; step < step_count; ++step) {
+            if (step % 3 == 2)
+                expected += "Removed 1 entries\n";
+            expected += date + " event " + to_string(step) + "\n";
+            if (step % 100 == 0)
+                expected += "Error: Month value is invalid: 13\n";
+        }
+        AssertEqual(replies[client], expected, "Server works incorrectly #1 for client " + to_string(client));
+    }
+
+    AssertEqual(ordered_replies[0], "Found 1 entries\n", "Server works incorrectly #2");
+    AssertEqual(ordered_replies[1], "Removed 1 entries\nFound 1 entries\n", "Server works incorrectly #3");
+    AssertEqual(ordered_replies[2], "2017-02-01 b\n2017-02-01 a\nFound 2 entries\n", "Server works incorrectly #4");
+
+    stringstream condition("date < 2017-2-1");
+    AssertEqual(db.CountIf(ParseCondition(condition)), client_count * (step_count - step_count / 3),
+                "Server works incorrectly #5");
+
+    AssertEqual(stopped, 1, "Server works incorrectly #6#1");
+    Assert(access(socket_path.c_str(), F_OK) != 0, "Server works incorrectly #6#2");
+    rmdir(directory);
+}
+
+void TestExecuteBatch() {
+    const vector<string> lines = {
+            "Find date > 1992-12-1",
+            "Del event == \"football\" OR date == 1992-12-10",
+            "Find",
+            "Del date == 1992-12-2",
+            "Find event != \"tennis\"",
+            "Del",
+            "Find",
+    };
+
+    Database db;
+    Database expected_db;
+
+    for (Database *target : {&db, &expected_db}) {
+        target->Add(Date(1992, 12, 1), "tennis");
+        target->Add(Date(1992, 12, 1), "football");
+        target->Add(Date(1992, 12, 2), "baseball");
+        target->Add(Date(1992, 12, 10), "handball");
+        target->Add(Date(1992, 12, 10), "football");
+    }
+
+    vector<Command> commands;
+    for (const string &line : lines) {
+        commands.push_back(ParseCommand(line));
+    }
+
+    stringstream output;
+    ExecuteBatch(db, commands, output);
+
+    AssertEqual(output.str(), ExecuteCommands(expected_db, lines), "Execute batch works incorrectly");
+    AssertEqual(db.GetStorageSize(), 0u, "Execute batch works incorrectly");
 }
 
 void TestAll() {
     TestRunner tr;
     tr.RunTest(TestParseEvent, "TestParseEvent");
+    tr.RunTest(TestEventBucket, "TestEventBucket");
+    tr.RunTest(TestEventKernels, "TestEventKernels");
     tr.RunTest(TestFindIf, "TestFindIf");
     tr.RunTest(TestRemoveIf, "TestRemoveIf");
+    tr.RunTest(TestVectorizedConditions, "TestVectorizedConditions");
+    tr.RunTest(TestCountIf, "TestCountIf");
     tr.RunTest(TestLast, "TestLast");
+    tr.RunTest(TestDateRange, "TestDateRange");
+    tr.RunTest(TestSimplifyCondition, "TestSimplifyCondition");
+    tr.RunTest(TestAdaptiveOrder, "TestAdaptiveOrder");
+    tr.RunTest(TestExplain, "TestExplain");
+    tr.RunTest(TestMemoryUsage, "TestMemoryUsage");
+    tr.RunTest(TestCompression, "TestCompression");
+    tr.RunTest(TestWriteBuffer, "TestWriteBuffer");
+    tr.RunTest(TestVersions, "TestVersions");
+    tr.RunTest(TestSubscriptions, "TestSubscriptions");
+    tr.RunTest(TestViews, "TestViews");
+    tr.RunTest(TestExpire, "TestExpire");
     tr.RunTest(TestPrint, "TestPrint");
+    tr.RunTest(TestExecuteCommand, "TestExecuteCommand");
+    tr.RunTest(TestExecuteBatch, "TestExecuteBatch");
     //tr.RunTest(TestParseCondition, "TestParseCondition");
 }
+
+void TestSystem() {
+    TestRunner tr;
+    tr.RunTest(TestPipeline, "TestPipeline");
+    tr.RunTest(TestTieredStorage, "TestTieredStorage");
+    tr.RunTest(TestServer, "TestServer");
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Estimates of heap bytes held by standard containers. Node sizes assume the
+// usual layouts: a tree node carries three links and a color next to its value,
+// a hash node carries a link and the cached hash.
+
+template<typename Value>
+constexpr size_t TreeNodeBytes() {
+    return 4 * sizeof(void *) + sizeof(Value);
+}
+
+template<typename Value>
+constexpr size_t HashNodeBytes() {
+    return 2 * sizeof(void *) + sizeof(Value);
+}
+
+// Zero for strings kept in the small string buffer
+inline size_t StringHeapBytes(const std::string &string) {
+    const char *begin = reinterpret_cast<const char *>(&string);
+    const bool in_place = string.data() >= begin && string.data() < begin + sizeof(string);
+    return in_place ? 0 : string.capacity() + 1;
+}
@@ -1,31 +1,428 @@
 #include "node.h"
+#include "event_kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace {
+
+// Events equal to this one match any event comparison
+const std::string_view SIGNAL_PILL = "{%signal%pill%}";
+
+// Evaluations of a logical node between decisions about the order of its operands
+const uint64_t REORDER_PERIOD = 1024;
+
+// Every this evaluation of an operand is timed
+const uint64_t TIMING_PERIOD = 64;
+
+// Number of evaluations after which profiles of operands are halved
+const uint64_t PROFILE_WINDOW = 1 << 16;
+
+}
+
+bool DateRange::IsEmpty() const {
+    if (!from || !to)
+        return false;
+
+    if (from->date == to->date)
+        return !from->inclusive || !to->inclusive;
+
+    return to->date < from->date;
+}
+
+bool DateRange::Contains(const Date &date) const {
+    if (from && (from->inclusive ? date < from->date : date <= from->date))
+        return false;
+
+    if (to && (to->inclusive ? date > to->date : date >= to->date))
+        return false;
+
+    return true;
+}
+
+std::ostream &operator<<(std::ostream &stream, const DateRange &range) {
+    if (range.IsEmpty())
+        return stream << "empty";
+
+    if (range.from)
+        stream << (range.from->inclusive ? "[" : "(") << range.from->date;
+    else
+        stream << "(-inf";
+
+    stream << ", ";
+
+    if (range.to)
+        stream << range.to->date << (range.to->inclusive ? "]" : ")");
+    else
+        stream << "+inf)";
+
+    return stream;
+}
+
+DateRange Intersect(const DateRange &lhs, const DateRange &rhs) {
+    DateRange result = lhs;
+
+    if (rhs.from && (!result.from || result.from->date < rhs.from->date
+                     || (result.from->date == rhs.from->date && !rhs.from->inclusive))) {
+        result.from = rhs.from;
+    }
+
+    if (rhs.to && (!result.to || rhs.to->date < result.to->date
+                   || (result.to->date == rhs.to->date && !rhs.to->inclusive))) {
+        result.to = rhs.to;
+    }
+
+    return result;
+}
+
+DateRange Unite(const DateRange &lhs, const DateRange &rhs) {
+    if (lhs.IsEmpty())
+        return rhs;
+    if (rhs.IsEmpty())
+        return lhs;
+
+    DateRange result;
+
+    if (lhs.from && rhs.from) {
+        result.from = lhs.from;
+        if (rhs.from->date < lhs.from->date || (rhs.from->date == lhs.from->date && rhs.from->inclusive))
+            result.from = rhs.from;
+    }
+
+    if (lhs.to && rhs.to) {
+        result.to = lhs.to;
+        if (lhs.to->date < rhs.to->date || (lhs.to->date == rhs.to->date && rhs.to->inclusive))
+            result.to = rhs.to;
+    }
+
+    return result;
+}
+
+bool EventRange::IsEmpty() const {
+    if (!from || !to)
+        return false;
+
+    if (from->event == to->event)
+        return !from->inclusive || !to->inclusive;
+
+    return to->event < from->event;
+}
+
+bool EventRange::Contains(std::string_view event) const {
+    if (from && (from->inclusive ? event < from->event : event <= from->event))
+        return false;
+
+    if (to && (to->inclusive ? event > to->event : event >= to->event))
+        return false;
+
+    return true;
+}
+
+EventRange Intersect(const EventRange &lhs, const EventRange &rhs) {
+    EventRange result = lhs;
+
+    if (rhs.from && (!result.from || result.from->event < rhs.from->event
+                     || (result.from->event == rhs.from->event && !rhs.from->inclusive))) {
+        result.from = rhs.from;
+    }
+
+    if (rhs.to && (!result.to || rhs.to->event < result.to->event
+                   || (result.to->event == rhs.to->event && !rhs.to->inclusive))) {
+        result.to = rhs.to;
+    }
+
+    return result;
+}
+
+EventRange Unite(const EventRange &lhs, const EventRange &rhs) {
+    if (lhs.IsEmpty())
+        return rhs;
+    if (rhs.IsEmpty())
+        return lhs;
+
+    EventRange result;
+
+    if (lhs.from && rhs.from) {
+        result.from = lhs.from;
+        if (rhs.from->event < lhs.from->event || (rhs.from->event == lhs.from->event && rhs.from->inclusive))
+            result.from = rhs.from;
+    }
+
+    if (lhs.to && rhs.to) {
+        result.to = lhs.to;
+        if (lhs.to->event < rhs.to->event || (lhs.to->event == rhs.to->event && rhs.to->inclusive))
+            result.to = rhs.to;
+    }
+
+    return result;
+}
+
+bool IsSignalPill(std::string_view event) {
+    return event == SIGNAL_PILL;
+}
+
+DateRange Node::GetDateRange() const {
+    return DateRange();
+}
+
+EventRange Node::GetEventRange() const {
+    return EventRange();
+}
+
+void Node::EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const {
+    mask.assign((events.Size() + 63) / 64, 0);
+
+    for (size_t i = 0; i < events.Size(); ++i) {
+        if (Evaluate(date, events.At(i)))
+            mask[i / 64] |= uint64_t(1) << (i % 64);
+    }
+}
 
 LogicalOperationNode::LogicalOperationNode(LogicalOperation operation,
                                            shared_ptr<Node> left, shared_ptr<Node> right) :
-        left(left), right(right), operation(operation) {
+        operands({left, right}), operation(operation), order({0, 1}), profiles(2) {
+}
+
+LogicalOperationNode::LogicalOperationNode(LogicalOperation operation, vector<shared_ptr<Node>> operands) :
+        operands(move(operands)), operation(operation), order(this->operands.size()),
+        profiles(this->operands.size()) {
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+}
+
+LogicalOperation LogicalOperationNode::GetOperation() const {
+    return operation;
+}
+
+const vector<shared_ptr<Node>> &LogicalOperationNode::GetOperands() const {
+    return operands;
 }
 
 bool LogicalOperationNode::Evaluate(const Date &date,
-                                    const std::string &event) const {
-    if (operation == LogicalOperation::And) {
-        return left.get()->Evaluate(date, event)
-               && right.get()->Evaluate(date, event);
+                                    std::string_view event) const {
+    // AND is decided by the first false operand, OR by the first true one
+    const bool decisive = operation == LogicalOperation::Or;
+
+    bool result = !decisive;
+    for (size_t index : order) {
+        if (EvaluateOperand(index, date, event) == decisive) {
+            result = decisive;
+            break;
+        }
+    }
+
+    if (++calls % REORDER_PERIOD == 0)
+        Reorder();
+
+    return result;
+}
+
+void LogicalOperationNode::EvaluateBucket(const Date &date, const EventBucket &events,
+                                          EventMask &mask) const {
+    EvaluateOperandBucket(order[0], date, events, mask);
+
+    EventMask operand_mask;
+    for (size_t i = 1; i < order.size(); ++i) {
+        // the rest of operands is skipped when the mask already decides every row
+        if (operation == LogicalOperation::And ? IsMaskEmpty(mask) : IsMaskFull(mask, events.Size()))
+            break;
+
+        EvaluateOperandBucket(order[i], date, events, operand_mask);
+
+        for (size_t word = 0; word < mask.size(); ++word) {
+            if (operation == LogicalOperation::And)
+                mask[word] &= operand_mask[word];
+            else
+                mask[word] |= operand_mask[word];
+        }
+    }
+
+    calls += events.Size();
+    if (calls >= REORDER_PERIOD) {
+        calls = 0;
+        Reorder();
+    }
+}
+
+bool LogicalOperationNode::EvaluateOperand(size_t index, const Date &date, std::string_view event) const {
+    OperandProfile &profile = profiles[index];
+    bool result;
+
+    // timing every evaluation would cost more than most evaluations do
+    if (profile.evaluations % TIMING_PERIOD == 0) {
+        const auto start = chrono::steady_clock::now();
+        result = operands[index]->Evaluate(date, event);
+        profile.nanoseconds += chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        profile.timed++;
     } else {
-        return left.get()->Evaluate(date, event)
-               || right.get()->Evaluate(date, event);
+        result = operands[index]->Evaluate(date, event);
     }
+
+    profile.evaluations++;
+    profile.passes += result;
+
+    return result;
 }
 
-bool EmptyNode::Evaluate(const Date &date, const std::string &event) const {
+void LogicalOperationNode::EvaluateOperandBucket(size_t index, const Date &date, const EventBucket &events,
+                                                 EventMask &mask) const {
+    OperandProfile &profile = profiles[index];
+
+    // buckets of a few events cost about as much as reading the clock, so they are sampled as rows are
+    if (profile.bucket_calls++ % TIMING_PERIOD == 0) {
+        const auto start = chrono::steady_clock::now();
+        operands[index]->EvaluateBucket(date, events, mask);
+        profile.nanoseconds += chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        profile.timed += events.Size();
+    } else {
+        operands[index]->EvaluateBucket(date, events, mask);
+    }
+
+    profile.evaluations += events.Size();
+    for (uint64_t word : mask) {
+        profile.passes += __builtin_popcountll(word);
+    }
+}
+
+void LogicalOperationNode::Reorder() const {
+    vector<double> ranks(operands.size());
+
+    for (size_t i = 0; i < operands.size(); ++i) {
+        OperandProfile &profile = profiles[i];
+
+        // an operand which has not been measured yet keeps its place
+        if (profile.timed == 0)
+            return;
+
+        const double cost = profile.nanoseconds / profile.timed;
+        const double pass_rate = static_cast<double>(profile.passes) / profile.evaluations;
+        const double decisive_rate = operation == LogicalOperation::And ? 1 - pass_rate : pass_rate;
+
+        // expected cost of evaluating the operand per decided row
+        ranks[i] = decisive_rate > 0 ? cost / decisive_rate : numeric_limits<double>::infinity();
+
+        // older measurements fade out, so the order follows changes in the data
+        if (profile.evaluations > PROFILE_WINDOW) {
+            profile.evaluations /= 2;
+            profile.passes /= 2;
+            profile.timed = (profile.timed + 1) / 2;
+            profile.nanoseconds /= 2;
+        }
+    }
+
+    stable_sort(order.begin(), order.end(), [&ranks](size_t lhs, size_t rhs) {
+        return ranks[lhs] < ranks[rhs];
+    });
+}
+
+bool LogicalOperationNode::DependsOnEvent() const {
+    for (const auto &operand : operands) {
+        if (operand->DependsOnEvent())
+            return true;
+    }
+    return false;
+}
+
+DateRange LogicalOperationNode::GetDateRange() const {
+    DateRange range = operands[0]->GetDateRange();
+
+    for (size_t i = 1; i < operands.size(); ++i) {
+        if (operation == LogicalOperation::And)
+            range = Intersect(range, operands[i]->GetDateRange());
+        else
+            range = Unite(range, operands[i]->GetDateRange());
+    }
+
+    return range;
+}
+
+EventRange LogicalOperationNode::GetEventRange() const {
+    EventRange range = operands[0]->GetEventRange();
+
+    for (size_t i = 1; i < operands.size(); ++i) {
+        if (operation == LogicalOperation::And)
+            range = Intersect(range, operands[i]->GetEventRange());
+        else
+            range = Unite(range, operands[i]->GetEventRange());
+    }
+
+    return range;
+}
+
+double LogicalOperationNode::EstimateSelectivity(const Statistics &statistics) const {
+    // operands are assumed to be independent
+    double selectivity = operation == LogicalOperation::And ? 1 : 0;
+
+    for (const auto &operand : operands) {
+        const double operand_selectivity = operand->EstimateSelectivity(statistics);
+
+        if (operation == LogicalOperation::And)
+            selectivity *= operand_selectivity;
+        else
+            selectivity += operand_selectivity - selectivity * operand_selectivity;
+    }
+
+    return selectivity;
+}
+
+bool EmptyNode::Evaluate(const Date &date, std::string_view event) const {
     return true;
 }
 
+void EmptyNode::EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const {
+    FillMask(mask, events.Size(), true);
+}
+
+bool EmptyNode::DependsOnEvent() const {
+    return false;
+}
+
+double EmptyNode::EstimateSelectivity(const Statistics &statistics) const {
+    return 1;
+}
+
+bool FalseNode::Evaluate(const Date &date, std::string_view event) const {
+    return false;
+}
+
+void FalseNode::EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const {
+    FillMask(mask, events.Size(), false);
+}
+
+bool FalseNode::DependsOnEvent() const {
+    return false;
+}
+
+double FalseNode::EstimateSelectivity(const Statistics &statistics) const {
+    return 0;
+}
+
+DateRange FalseNode::GetDateRange() const {
+    // any range with bounds excluding each other is empty
+    const Date date(0, 1, 1);
+    return DateRange{DateBound{date, false}, DateBound{date, false}};
+}
+
+EventRange FalseNode::GetEventRange() const {
+    return EventRange{EventBound{"", false}, EventBound{"", false}};
+}
+
 DateComparisonNode::DateComparisonNode(const Comparison &comparison,
                                        const Date &date) :
         comparison(comparison), date(date) {
 }
 
-bool DateComparisonNode::Evaluate(const Date &date, const std::string &event) const {
+Comparison DateComparisonNode::GetComparison() const {
+    return comparison;
+}
+
+const Date &DateComparisonNode::GetDate() const {
+    return date;
+}
+
+bool DateComparisonNode::Evaluate(const Date &date, std::string_view event) const {
     switch (comparison) {
         case Comparison::Equal:
             return date == this->date;
@@ -43,15 +440,137 @@ bool DateComparisonNode::Evaluate(const Date &date, const std::string &event) co
     return false;
 }
 
+// all events of a bucket share its date, so the date is compared once per bucket
+void DateComparisonNode::EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const {
+    FillMask(mask, events.Size(), Evaluate(date, ""));
+}
+
+bool DateComparisonNode::DependsOnEvent() const {
+    return false;
+}
+
+DateRange DateComparisonNode::GetDateRange() const {
+    DateRange result;
+
+    switch (comparison) {
+        case Comparison::Equal:
+            result.from = DateBound{date, true};
+            result.to = DateBound{date, true};
+            break;
+        case Comparison::Greater:
+            result.from = DateBound{date, false};
+            break;
+        case Comparison::GreaterOrEqual:
+            result.from = DateBound{date, true};
+            break;
+        case Comparison::Less:
+            result.to = DateBound{date, false};
+            break;
+        case Comparison::LessOrEqual:
+            result.to = DateBound{date, true};
+            break;
+        case Comparison::NotEqual:
+            break;
+    }
+
+    return result;
+}
+
+double DateComparisonNode::EstimateSelectivity(const Statistics &statistics) const {
+    if (statistics.GetEventCount() == 0)
+        return 0;
+
+    if (comparison == Comparison::NotEqual) {
+        const DateRange equal{DateBound{date, true}, DateBound{date, true}};
+        return 1 - statistics.EstimateRows(equal) / statistics.GetEventCount();
+    }
+
+    return statistics.EstimateRows(GetDateRange()) / statistics.GetEventCount();
+}
+
 EventComparisonNode::EventComparisonNode(const Comparison &comparison,
                                          const string &event) :
         comparison(comparison), event(event) {
 }
 
-bool EventComparisonNode::Evaluate(const Date &date, const std::string &event) const {
+Comparison EventComparisonNode::GetComparison() const {
+    return comparison;
+}
+
+const string &EventComparisonNode::GetEvent() const {
+    return event;
+}
+
+bool EventComparisonNode::Evaluate(const Date &date, std::string_view event) const {
+
+    if (event == SIGNAL_PILL) return true;
+
+    return Compare(event);
+}
+
+void EventComparisonNode::EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const {
+    CompareEvents(events, comparison, event, mask);
 
-    if (event == "{%signal%pill%}") return true;
+    // signal pill matches any comparison, so its row is added unless the comparison accepts it anyway
+    if (!Compare(SIGNAL_PILL)) {
+        EventMask pills;
+        CompareEvents(events, Comparison::Equal, SIGNAL_PILL, pills);
+
+        for (size_t i = 0; i < mask.size(); ++i) {
+            mask[i] |= pills[i];
+        }
+    }
+}
+
+bool EventComparisonNode::DependsOnEvent() const {
+    return true;
+}
+
+double EventComparisonNode::EstimateSelectivity(const Statistics &statistics) const {
+    if (statistics.GetEventCount() == 0)
+        return 0;
+
+    const double equal = static_cast<double>(statistics.GetEventCount(event)) / statistics.GetEventCount();
+
+    switch (comparison) {
+        case Comparison::Equal:
+            return equal;
+        case Comparison::NotEqual:
+            return 1 - equal;
+        default:
+            // nothing is known about the order of events, a third is the usual guess
+            return 1.0 / 3;
+    }
+}
+
+EventRange EventComparisonNode::GetEventRange() const {
+    EventRange result;
+
+    switch (comparison) {
+        case Comparison::Equal:
+            result.from = EventBound{event, true};
+            result.to = EventBound{event, true};
+            break;
+        case Comparison::Greater:
+            result.from = EventBound{event, false};
+            break;
+        case Comparison::GreaterOrEqual:
+            result.from = EventBound{event, true};
+            break;
+        case Comparison::Less:
+            result.to = EventBound{event, false};
+            break;
+        case Comparison::LessOrEqual:
+            result.to = EventBound{event, true};
+            break;
+        case Comparison::NotEqual:
+            break;
+    }
+
+    return result;
+}
 
+bool EventComparisonNode::Compare(std::string_view event) const {
     switch (comparison) {
         case Comparison::Equal:
             return event == this->event;
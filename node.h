@@ -2,12 +2,16 @@
 
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stack>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cstdint>
 
 #include "date.h"
+#include "event_bucket.h"
+#include "statistics.h"
 
 using namespace std;
 
@@ -19,12 +23,97 @@ enum Comparison {
     Less, LessOrEqual, Greater, GreaterOrEqual, Equal, NotEqual
 };
 
+// One end of a date range, open when the date itself is excluded
+struct DateBound {
+    Date date;
+    bool inclusive;
+};
+
+// Dates for which a condition may be true, a missing bound means the range is unbounded
+struct DateRange {
+    std::optional<DateBound> from;
+    std::optional<DateBound> to;
+
+    bool IsEmpty() const;
+
+    bool Contains(const Date &date) const;
+};
+
+// Writes range as [from, to) with -inf and +inf for missing bounds
+std::ostream &operator<<(std::ostream &stream, const DateRange &range);
+
+DateRange Intersect(const DateRange &lhs, const DateRange &rhs);
+
+// Smallest range containing both ranges
+DateRange Unite(const DateRange &lhs, const DateRange &rhs);
+
+// One end of an event range, open when the event itself is excluded
+struct EventBound {
+    std::string event;
+    bool inclusive;
+};
+
+// Events for which a condition may be true in lexicographic order, a missing bound
+// means the range is unbounded. The signal pill is the exception, see IsSignalPill.
+struct EventRange {
+    std::optional<EventBound> from;
+    std::optional<EventBound> to;
+
+    bool IsEmpty() const;
+
+    bool Contains(std::string_view event) const;
+};
+
+EventRange Intersect(const EventRange &lhs, const EventRange &rhs);
+
+// Smallest range containing both ranges
+EventRange Unite(const EventRange &lhs, const EventRange &rhs);
+
+// The signal pill matches any event comparison, whatever the event range of the condition
+bool IsSignalPill(std::string_view event);
+
 struct Node {
-    virtual bool Evaluate(const Date &date, const std::string &event) const = 0;
+    virtual bool Evaluate(const Date &date, std::string_view event) const = 0;
+
+    // Evaluates the condition for every event of the bucket, bit i of mask is set if event i matches
+    virtual void EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const;
+
+    // False if the condition gives the same answer for every event of a date
+    virtual bool DependsOnEvent() const = 0;
+
+    // Condition is false for every date outside of the range
+    virtual DateRange GetDateRange() const;
+
+    // Condition is false for every event outside of the range
+    virtual EventRange GetEventRange() const;
+
+    // Expected share of entries matching the condition
+    virtual double EstimateSelectivity(const Statistics &statistics) const = 0;
 };
 
 struct EmptyNode : public Node {
-    bool Evaluate(const Date &date, const std::string &event) const override;
+    bool Evaluate(const Date &date, std::string_view event) const override;
+
+    void EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const override;
+
+    bool DependsOnEvent() const override;
+
+    double EstimateSelectivity(const Statistics &statistics) const override;
+};
+
+// Condition which is false for every entry
+struct FalseNode : public Node {
+    bool Evaluate(const Date &date, std::string_view event) const override;
+
+    void EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const override;
+
+    bool DependsOnEvent() const override;
+
+    double EstimateSelectivity(const Statistics &statistics) const override;
+
+    DateRange GetDateRange() const override;
+
+    EventRange GetEventRange() const override;
 };
 
 struct LogicalOperationNode : public Node {
@@ -32,19 +121,69 @@ public:
     LogicalOperationNode(LogicalOperation operation, shared_ptr<Node> left,
                          shared_ptr<Node> right);
 
-    bool Evaluate(const Date &date, const std::string &event) const override;
+    LogicalOperationNode(LogicalOperation operation, vector<shared_ptr<Node>> operands);
+
+    LogicalOperation GetOperation() const;
+
+    const vector<shared_ptr<Node>> &GetOperands() const;
+
+    bool Evaluate(const Date &date, std::string_view event) const override;
+
+    void EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const override;
+
+    bool DependsOnEvent() const override;
+
+    double EstimateSelectivity(const Statistics &statistics) const override;
+
+    DateRange GetDateRange() const override;
+
+    EventRange GetEventRange() const override;
 
 private:
-    shared_ptr<Node> left;
-    shared_ptr<Node> right;
+    // What evaluating an operand has cost so far and how often it passed, per row
+    struct OperandProfile {
+        uint64_t evaluations = 0;
+        uint64_t passes = 0;
+        uint64_t timed = 0;
+        double nanoseconds = 0;
+        uint64_t bucket_calls = 0;  // bucket evaluations, every TIMING_PERIOD one is timed
+    };
+
+    bool EvaluateOperand(size_t index, const Date &date, std::string_view event) const;
+
+    void EvaluateOperandBucket(size_t index, const Date &date, const EventBucket &events,
+                               EventMask &mask) const;
+
+    // Puts cheaper operands which decide the result more often first
+    void Reorder() const;
+
+    vector<shared_ptr<Node>> operands;
     LogicalOperation operation;
+
+    // evaluation order adapts to the data while the condition is evaluated,
+    // operands are free of side effects so the result never depends on it
+    mutable vector<size_t> order;
+    mutable vector<OperandProfile> profiles;
+    mutable uint64_t calls = 0;
 };
 
 struct DateComparisonNode : public Node {
 public:
     DateComparisonNode(const Comparison &comparison, const Date &date);
 
-    bool Evaluate(const Date &date, const std::string &event) const override;
+    Comparison GetComparison() const;
+
+    const Date &GetDate() const;
+
+    bool Evaluate(const Date &date, std::string_view event) const override;
+
+    void EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const override;
+
+    bool DependsOnEvent() const override;
+
+    double EstimateSelectivity(const Statistics &statistics) const override;
+
+    DateRange GetDateRange() const override;
 
 private:
     Comparison comparison;
@@ -55,9 +194,23 @@ struct EventComparisonNode : public Node {
 public:
     EventComparisonNode(const Comparison &comparison, const string &event);
 
-    bool Evaluate(const Date &date, const std::string &event) const override;
+    Comparison GetComparison() const;
+
+    const string &GetEvent() const;
+
+    bool Evaluate(const Date &date, std::string_view event) const override;
+
+    void EvaluateBucket(const Date &date, const EventBucket &events, EventMask &mask) const override;
+
+    bool DependsOnEvent() const override;
+
+    double EstimateSelectivity(const Statistics &statistics) const override;
+
+    EventRange GetEventRange() const override;
 
 private:
+    bool Compare(std::string_view event) const;
+
     Comparison comparison;
     string event;
 };
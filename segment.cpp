@@ -0,0 +1,120 @@
+#include "segment.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+#include <system_error>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+void ThrowSystemError(const std::string &what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+void WriteAll(int fd, const std::string &bytes, const std::string &path) {
+    for (size_t written = 0; written < bytes.size();) {
+        const ssize_t result = write(fd, bytes.data() + written, bytes.size() - written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            ThrowSystemError("write " + path);
+        }
+        written += result;
+    }
+}
+
+}
+
+Segment::Segment(std::string new_path, const std::vector<std::pair<Date, std::string>> &buckets)
+        : path(std::move(new_path)), first(buckets.front().first), last(buckets.back().first) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        ThrowSystemError("open " + path);
+
+    entries.reserve(buckets.size());
+
+    try {
+        uint64_t offset = 0;
+        for (const auto &bucket : buckets) {
+            WriteAll(fd, bucket.second, path);
+            entries.push_back({bucket.first, static_cast<uint32_t>(bucket.second.size()), offset});
+            offset += bucket.second.size();
+        }
+    } catch (...) {
+        close(fd);
+        unlink(path.c_str());
+        throw;
+    }
+}
+
+Segment::~Segment() {
+    close(fd);
+    unlink(path.c_str());
+}
+
+const Date &Segment::First() const {
+    return first;
+}
+
+const Date &Segment::Last() const {
+    return last;
+}
+
+std::vector<Segment::Entry>::const_iterator Segment::Find(const Date &date) const {
+    auto it = std::lower_bound(entries.begin(), entries.end(), date, [](const Entry &entry, const Date &date) {
+        return entry.date < date;
+    });
+
+    if (it != entries.end() && it->date != date)
+        return entries.end();
+    return it;
+}
+
+bool Segment::Contains(const Date &date) const {
+    return first <= date && date <= last && Find(date) != entries.end();
+}
+
+std::string Segment::Read(const Date &date) const {
+    return Read(*Find(date));
+}
+
+std::string Segment::Read(const Entry &entry) const {
+    std::string bytes(entry.length, '\0');
+    for (size_t read = 0; read < bytes.size();) {
+        const ssize_t result = pread(fd, &bytes[read], bytes.size() - read, entry.offset + read);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            ThrowSystemError("read " + path);
+        read += result;
+    }
+
+    return bytes;
+}
+
+void Segment::ReadAll(std::vector<std::pair<Date, std::string>> &buckets) const {
+    for (const Entry &entry : entries) {
+        buckets.emplace_back(entry.date, Read(entry));
+    }
+}
+
+void Segment::Drop(const Date &date) {
+    const auto it = Find(date);
+    if (it != entries.end())
+        entries.erase(it);
+}
+
+size_t Segment::Size() const {
+    return entries.size();
+}
+
+bool Segment::Empty() const {
+    return entries.empty();
+}
+
+size_t Segment::MemoryUsage() const {
+    return entries.capacity() * sizeof(Entry) + StringHeapBytes(path);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "date.h"
+
+// Buckets spilled out of memory, front-coded and sorted by date in one immutable file.
+// Only the directory of dates with their file offsets is kept in memory. Dates are
+// dropped from the directory when their buckets go back to memory, their bytes stay
+// in the file until the segment is destroyed, which removes the file.
+class Segment {
+public:
+    // Writes the packed buckets, which must be sorted by date, to a new file at path
+    Segment(std::string path, const std::vector<std::pair<Date, std::string>> &buckets);
+
+    ~Segment();
+
+    Segment(const Segment &) = delete;
+
+    Segment &operator=(const Segment &) = delete;
+
+    // Date range of the written buckets, dropped dates included
+    const Date &First() const;
+
+    const Date &Last() const;
+
+    bool Contains(const Date &date) const;
+
+    // Packed events of the date, which must be in the directory.
+    // Reads do not change the segment and may run concurrently.
+    std::string Read(const Date &date) const;
+
+    // Appends the packed events of all dates in the directory, in date order
+    void ReadAll(std::vector<std::pair<Date, std::string>> &buckets) const;
+
+    void Drop(const Date &date);
+
+    // Number of dates in the directory
+    size_t Size() const;
+
+    // True once all dates have been dropped
+    bool Empty() const;
+
+    size_t MemoryUsage() const;
+
+private:
+    struct Entry {
+        Date date;
+        uint32_t length;
+        uint64_t offset;
+    };
+
+    std::vector<Entry>::const_iterator Find(const Date &date) const;
+
+    std::string Read(const Entry &entry) const;
+
+    std::string path;
+    int fd = -1;
+    Date first;
+    Date last;
+    std::vector<Entry> entries;
+};
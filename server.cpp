@@ -0,0 +1,461 @@
+#include "server.h"
+#include "commands.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// Lines are parsed as they arrive, so that writes get their tickets by the command type
+struct PendingLine {
+    Command command;
+    std::string error;      // reply to a line which failed to parse
+    bool read_only;
+    uint64_t write_ticket;
+};
+
+struct Connection {
+    explicit Connection(int fd) : fd(fd) {}
+
+    const int fd;
+
+    // owned by the loop thread
+    std::string input;
+    bool peer_closed = false;
+    bool waiting_output = false;
+
+    // guarded by Server::mutex
+    std::deque<PendingLine> pending;
+    std::string output;
+    bool busy = false;
+    bool closed = false;
+};
+
+void ThrowSystemError(const std::string &what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+void SetNonBlocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ThrowSystemError("fcntl");
+    }
+}
+
+class Server {
+public:
+    Server(Database &db, const std::string &socket_path, size_t worker_count, int stop_fd);
+
+    ~Server();
+
+    void Run();
+
+private:
+    void Accept();
+
+    void Read(const std::shared_ptr<Connection> &connection);
+
+    void Flush(const std::shared_ptr<Connection> &connection);
+
+    void CloseIfDone(const std::shared_ptr<Connection> &connection);
+
+    void Close(const std::shared_ptr<Connection> &connection);
+
+    void Work();
+
+    void Execute(const PendingLine &pending, std::ostream &os);
+
+    Database &db;
+    std::shared_mutex database_mutex;
+
+    const std::string socket_path;
+    const int stop_fd;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+
+    // owned by the loop thread
+    std::map<int, std::shared_ptr<Connection>> connections;
+    uint64_t next_write_ticket = 0;
+
+    // connections with a command ready for a worker, connections with new output
+    // and writes which arrived before their turn, all guarded by mutex
+    std::mutex mutex;
+    std::condition_variable tasks_ready;
+    std::deque<std::shared_ptr<Connection>> tasks;
+    std::vector<std::shared_ptr<Connection>> flushes;
+    std::map<uint64_t, std::shared_ptr<Connection>> parked_writes;
+    uint64_t current_write_ticket = 0;
+    bool stopping = false;
+
+    std::vector<std::thread> workers;
+};
+
+Server::Server(Database &db, const std::string &socket_path, size_t worker_count, int stop_fd)
+        : db(db), socket_path(socket_path), stop_fd(stop_fd) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path is too long: " + socket_path);
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        ThrowSystemError("socket");
+    }
+
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+        ThrowSystemError("bind " + socket_path);
+    }
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        ThrowSystemError("listen");
+    }
+    SetNonBlocking(listen_fd);
+
+    epoll_fd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        ThrowSystemError("epoll");
+    }
+
+    for (int fd : {listen_fd, wake_fd, stop_fd}) {
+        if (fd < 0)
+            continue;
+
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    for (size_t i = 0; i < std::max<size_t>(worker_count, 1); ++i) {
+        workers.emplace_back(&Server::Work, this);
+    }
+}
+
+Server::~Server() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    tasks_ready.notify_all();
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    for (const auto &item : connections) {
+        close(item.first);
+    }
+    for (int fd : {listen_fd, epoll_fd, wake_fd}) {
+        if (fd >= 0)
+            close(fd);
+    }
+    unlink(socket_path.c_str());
+}
+
+void Server::Run() {
+    std::vector<epoll_event> events(64);
+
+    while (true) {
+        const int count = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            ThrowSystemError("epoll_wait");
+        }
+
+        for (int i = 0; i < count; ++i) {
+            const int fd = events[i].data.fd;
+
+            if (fd == stop_fd) {
+                return;
+            } else if (fd == listen_fd) {
+                Accept();
+            } else if (fd == wake_fd) {
+                uint64_t value;
+                while (read(wake_fd, &value, sizeof(value)) > 0) {}
+
+                std::vector<std::shared_ptr<Connection>> ready;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ready.swap(flushes);
+                }
+
+                for (const auto &connection : ready) {
+                    if (connections.count(connection->fd) && connections.at(connection->fd) == connection)
+                        Flush(connection);
+                }
+            } else {
+                auto it = connections.find(fd);
+                if (it == connections.end())
+                    continue;
+
+                const auto connection = it->second;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    Read(connection);
+                if (events[i].events & EPOLLOUT)
+                    Flush(connection);
+            }
+        }
+    }
+}
+
+void Server::Accept() {
+    while (true) {
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+
+        SetNonBlocking(fd);
+        connections[fd] = std::make_shared<Connection>(fd);
+
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+void Server::Read(const std::shared_ptr<Connection> &connection) {
+    char buffer[1 << 14];
+
+    while (true) {
+        const ssize_t size = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (size > 0) {
+            connection->input.append(buffer, size);
+            continue;
+        }
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (size < 0 && errno == EINTR)
+            continue;
+
+        // the last line may come without line feed, same as for getline on stdin
+        connection->peer_closed = true;
+        if (!connection->input.empty())
+            connection->input.push_back('\n');
+        break;
+    }
+
+    std::vector<PendingLine> lines;
+    size_t begin = 0;
+    for (size_t end; (end = connection->input.find('\n', begin)) != std::string::npos; begin = end + 1) {
+        PendingLine pending;
+        try {
+            pending.command = ParseCommand(connection->input.substr(begin, end - begin));
+        } catch (std::exception &e) {
+            pending.error = e.what();
+        }
+        pending.read_only = IsReadOnlyCommand(pending.command);
+        pending.write_ticket = pending.read_only ? 0 : next_write_ticket++;
+        lines.push_back(std::move(pending));
+    }
+    connection->input.erase(0, begin);
+
+    if (!lines.empty()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &pending : lines) {
+            connection->pending.push_back(std::move(pending));
+        }
+        if (!connection->busy) {
+            connection->busy = true;
+            tasks.push_back(connection);
+            tasks_ready.notify_one();
+        }
+    }
+
+    if (connection->peer_closed) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+        CloseIfDone(connection);
+    }
+}
+
+void Server::Flush(const std::shared_ptr<Connection> &connection) {
+    bool failed = false;
+    bool blocked = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t sent = 0;
+        while (sent < connection->output.size()) {
+            const ssize_t size = send(connection->fd, connection->output.data() + sent,
+                                      connection->output.size() - sent, MSG_NOSIGNAL);
+            if (size >= 0) {
+                sent += size;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                blocked = true;
+                break;
+            } else if (errno != EINTR) {
+                failed = true;
+                break;
+            }
+        }
+        connection->output.erase(0, sent);
+    }
+
+    if (failed) {
+        Close(connection);
+        return;
+    }
+
+    // wait for the socket to drain only while there is something left to send
+    if (blocked != connection->waiting_output) {
+        connection->waiting_output = blocked;
+
+        uint32_t mask = 0;
+        if (!connection->peer_closed)
+            mask |= EPOLLIN;
+        if (blocked)
+            mask |= EPOLLOUT;
+
+        epoll_event event{};
+        event.events = mask;
+        event.data.fd = connection->fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event);
+    }
+
+    CloseIfDone(connection);
+}
+
+void Server::CloseIfDone(const std::shared_ptr<Connection> &connection) {
+    bool done;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = connection->peer_closed && !connection->busy && connection->output.empty();
+    }
+
+    if (done)
+        Close(connection);
+}
+
+void Server::Close(const std::shared_ptr<Connection> &connection) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (connection->closed)
+            return;
+        connection->closed = true;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+    close(connection->fd);
+    connections.erase(connection->fd);
+}
+
+void Server::Work() {
+    while (true) {
+        std::shared_ptr<Connection> connection;
+        PendingLine pending;
+        bool closed;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            tasks_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (stopping)
+                return;
+
+            connection = tasks.front();
+            tasks.pop_front();
+
+            // a write which came too early waits for its turn without holding the worker
+            const PendingLine &front = connection->pending.front();
+            if (!front.read_only && front.write_ticket != current_write_ticket) {
+                parked_writes[front.write_ticket] = connection;
+                continue;
+            }
+
+            pending = std::move(connection->pending.front());
+            connection->pending.pop_front();
+            closed = connection->closed;
+        }
+
+        std::ostringstream os;
+        if (!closed)
+            Execute(pending, os);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!pending.read_only) {
+                current_write_ticket++;
+
+                auto parked = parked_writes.find(current_write_ticket);
+                if (parked != parked_writes.end()) {
+                    tasks.push_back(parked->second);
+                    parked_writes.erase(parked);
+                    tasks_ready.notify_one();
+                }
+            }
+
+            connection->output += os.str();
+            if (!connection->pending.empty()) {
+                tasks.push_back(connection);
+                tasks_ready.notify_one();
+            } else {
+                connection->busy = false;
+            }
+            flushes.push_back(connection);
+        }
+
+        const uint64_t value = 1;
+        ssize_t ignored = write(wake_fd, &value, sizeof(value));
+        (void) ignored;
+    }
+}
+
+void Server::Execute(const PendingLine &pending, std::ostream &os) {
+    if (!pending.error.empty()) {
+        os << "Error: " << pending.error << std::endl;
+        return;
+    }
+
+    try {
+        if (pending.read_only) {
+            std::shared_lock<std::shared_mutex> lock(database_mutex);
+
+            // buffered Adds are merged under the exclusive lock, readers never change the database
+            while (db.HasBufferedAdds()) {
+                lock.unlock();
+                {
+                    std::unique_lock<std::shared_mutex> write_lock(database_mutex);
+                    db.Flush();
+                }
+                lock.lock();
+            }
+
+            ExecuteCommand(db, pending.command, os);
+        } else {
+            std::unique_lock<std::shared_mutex> lock(database_mutex);
+            ExecuteCommand(db, pending.command, os);
+        }
+    } catch (std::exception &e) {
+        os << "Error: " << e.what() << std::endl;
+    }
+}
+
+}
+
+void RunServer(Database &db, const std::string &socket_path, size_t worker_count, int stop_fd) {
+    Server server(db, socket_path, worker_count, stop_fd);
+    server.Run();
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+#include "database.h"
+
+// Serves the command protocol to many clients over a Unix domain socket.
+// Connections are multiplexed by one epoll loop, commands are executed by
+// worker_count threads: reads run concurrently, writes one at a time in the
+// order they arrived. Replies to pipelined commands keep the order of the
+// commands within a connection. Runs until stop_fd becomes readable, or until the
+// process is stopped without one; commands which have not started by then are dropped
+// and the socket file is removed.
+void RunServer(Database &db, const std::string &socket_path, size_t worker_count, int stop_fd = -1);
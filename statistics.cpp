@@ -0,0 +1,132 @@
+#include "statistics.h"
+#include "event_bucket.h"
+#include "node.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Each row of the sketch hashes events to its own counters, the smallest counter is the estimate
+const size_t SKETCH_WIDTH = 1024;
+const size_t SKETCH_DEPTH = 4;
+
+int64_t MonthKey(const Date &date) {
+    return static_cast<int64_t>(date.GetYear()) * 12 + date.GetMonth() - 1;
+}
+
+}
+
+template<typename Visitor>
+void Statistics::VisitCounters(std::string_view event, Visitor visitor) const {
+    // the halves of the hash give the counters of all rows as in double hashing
+    const uint64_t hash = StableEventHash(event);
+    const uint64_t step = (hash >> 32) | 1;
+
+    for (size_t row = 0; row < SKETCH_DEPTH; ++row) {
+        visitor(row * SKETCH_WIDTH + (static_cast<uint32_t>(hash) + row * step) % SKETCH_WIDTH);
+    }
+}
+
+void Statistics::Add(const Date &date, std::string_view event) {
+    events++;
+
+    if (months[MonthKey(date)]++ == 0)
+        node_bytes += TreeNodeBytes<std::pair<const int64_t, int>>();
+
+    if (sketch.empty())
+        sketch.assign(SKETCH_WIDTH * SKETCH_DEPTH, 0);
+
+    // counters of removed buckets are halved once they make up most of the sketch,
+    // which keeps the proportions and the counters from growing without bound
+    if (sketch_events >= 2 * static_cast<int64_t>(events) + static_cast<int64_t>(SKETCH_WIDTH)) {
+        for (int32_t &counter : sketch) {
+            counter /= 2;
+        }
+        sketch_events /= 2;
+    }
+
+    sketch_events++;
+    VisitCounters(event, [this](size_t counter) { sketch[counter]++; });
+}
+
+void Statistics::Remove(const Date &date, std::string_view event) {
+    RemoveBucket(date, 1);
+
+    // counters may have been halved since the event was added
+    sketch_events--;
+    VisitCounters(event, [this](size_t counter) {
+        if (sketch[counter] > 0)
+            sketch[counter]--;
+    });
+}
+
+void Statistics::RemoveBucket(const Date &date, int size) {
+    events -= size;
+
+    auto month = months.find(MonthKey(date));
+    month->second -= size;
+    if (month->second == 0) {
+        node_bytes -= TreeNodeBytes<std::pair<const int64_t, int>>();
+        months.erase(month);
+    }
+}
+
+int Statistics::GetEventCount() const {
+    return events;
+}
+
+int Statistics::GetEventCount(std::string_view event) const {
+    if (sketch.empty() || sketch_events <= 0)
+        return 0;
+
+    int32_t count = INT32_MAX;
+    VisitCounters(event, [this, &count](size_t counter) { count = std::min(count, sketch[counter]); });
+
+    // the counts of removed buckets are still in the sketch, the entries left keep their share
+    return static_cast<int>(std::min<int64_t>(count, static_cast<int64_t>(count) * events / sketch_events));
+}
+
+int Statistics::GetDistinctEventCount() const {
+    if (events == 0 || sketch.empty())
+        return 0;
+
+    // linear counting over the first row
+    const auto used = std::count_if(sketch.begin(), sketch.begin() + SKETCH_WIDTH, [](int32_t counter) {
+        return counter > 0;
+    });
+    if (static_cast<size_t>(used) == SKETCH_WIDTH)
+        return events;
+
+    const double estimate = -static_cast<double>(SKETCH_WIDTH) * std::log(1 - static_cast<double>(used) / SKETCH_WIDTH);
+    return std::min(events, static_cast<int>(std::lround(estimate)));
+}
+
+double Statistics::EstimateRows(const DateRange &range) const {
+    if (range.IsEmpty())
+        return 0;
+
+    auto begin = range.from ? months.lower_bound(MonthKey(range.from->date)) : months.begin();
+    auto end = range.to ? months.upper_bound(MonthKey(range.to->date)) : months.end();
+
+    double rows = 0;
+    for (auto it = begin; it != end; ++it) {
+        // days of a month are counted up to 31 as Date allows them
+        double first_day = 1;
+        double last_day = 31;
+
+        if (range.from && it->first == MonthKey(range.from->date))
+            first_day = range.from->date.GetDay() + (range.from->inclusive ? 0 : 1);
+        if (range.to && it->first == MonthKey(range.to->date))
+            last_day = range.to->date.GetDay() - (range.to->inclusive ? 0 : 1);
+
+        rows += it->second * std::max(0.0, last_day - first_day + 1) / 31;
+    }
+
+    return rows;
+}
+
+size_t Statistics::MemoryUsage() const {
+    return node_bytes + sketch.capacity() * sizeof(int32_t);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string_view>
+#include <vector>
+
+#include "date.h"
+
+struct DateRange;
+
+// Cardinality statistics of the database, maintained on every added and removed entry.
+// Entry counts are exact and kept per month, so a whole bucket is removed by its size
+// without looking at its events. Event frequencies come from a count-min sketch of a
+// fixed size instead of a map of every distinct event.
+class Statistics {
+public:
+    void Add(const Date &date, std::string_view event);
+
+    void Remove(const Date &date, std::string_view event);
+
+    // Removes size entries of the date, their events stay in the sketch and
+    // are discounted in proportion to the entries which are left
+    void RemoveBucket(const Date &date, int size);
+
+    int GetEventCount() const;
+
+    // Estimated number of entries with exactly this event, never less than the
+    // actual number unless whole buckets were removed
+    int GetEventCount(std::string_view event) const;
+
+    // Estimated from the share of sketch counters in use
+    int GetDistinctEventCount() const;
+
+    // Expected number of entries with dates in the range, months which are
+    // covered partially contribute in proportion to the covered days
+    double EstimateRows(const DateRange &range) const;
+
+    // Heap bytes held by the statistics
+    size_t MemoryUsage() const;
+
+private:
+    // Counter of the event in every row of the sketch
+    template<typename Visitor>
+    void VisitCounters(std::string_view event, Visitor visitor) const;
+
+    int events = 0;
+    size_t node_bytes = 0;
+    std::map<int64_t, int> months;
+
+    // rows of counters one after another, allocated by the first Add
+    std::vector<int32_t> sketch;
+    int64_t sketch_events = 0;     // entries counted in the sketch, those of removed buckets included
+};
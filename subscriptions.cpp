@@ -0,0 +1,238 @@
+#include "subscriptions.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+
+namespace {
+
+// False if the value is not in the index under the key
+template<typename Index, typename Value>
+bool EraseFromIndex(Index &index, const typename Index::key_type &key, const Value *value) {
+    const auto range = index.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == value) {
+            index.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Heap bytes of a queue of deltas, its spare capacity included
+size_t DeltaBytes(const std::vector<SubscriptionDelta> &deltas) {
+    size_t bytes = deltas.capacity() * sizeof(SubscriptionDelta);
+    for (const SubscriptionDelta &delta : deltas) {
+        bytes += StringHeapBytes(delta.event);
+    }
+    return bytes;
+}
+
+bool IsSingleEvent(const EventRange &range) {
+    return range.from && range.to && range.from->inclusive && range.to->inclusive
+           && range.from->event == range.to->event;
+}
+
+// Heap bytes of the latest entry of a view
+size_t LatestBytes(const ViewResult &result) {
+    return result.latest ? StringHeapBytes(result.latest->second) : 0;
+}
+
+std::optional<Date> RangeStart(const DateRange &range) {
+    if (!range.from)
+        return std::nullopt;
+    return range.from->date;
+}
+
+}
+
+uint64_t SubscriptionIndex::Subscribe(std::shared_ptr<Node> condition) {
+    return Register(std::move(condition), std::nullopt);
+}
+
+uint64_t SubscriptionIndex::CreateView(std::shared_ptr<Node> condition, ViewResult result,
+                                       std::map<Date, int> matching_dates) {
+    View view;
+    view.result = std::move(result);
+    view.matching_dates = std::move(matching_dates);
+    bytes += view.matching_dates.size() * TreeNodeBytes<std::pair<const Date, int>>() + LatestBytes(view.result);
+    return Register(std::move(condition), std::move(view));
+}
+
+uint64_t SubscriptionIndex::Register(std::shared_ptr<Node> condition, std::optional<View> view) {
+    const uint64_t id = next_id++;
+
+    Subscription &subscription = subscriptions[id];
+    subscription.condition = std::move(condition);
+    subscription.dates = subscription.condition->GetDateRange();
+    subscription.events = subscription.condition->GetEventRange();
+    subscription.view = std::move(view);
+    bytes += TreeNodeBytes<std::pair<const uint64_t, Subscription>>();
+
+    // a condition with an empty range is left to the signal pill, which visits every subscription
+    if (subscription.dates.IsEmpty() || subscription.events.IsEmpty())
+        return id;
+
+    if (IsSingleEvent(subscription.events)) {
+        by_event.emplace(subscription.events.from->event, &subscription);
+        bytes += TreeNodeBytes<std::pair<const std::string, Subscription *>>();
+    } else {
+        by_date.emplace(RangeStart(subscription.dates), &subscription);
+        bytes += TreeNodeBytes<std::pair<const std::optional<Date>, Subscription *>>();
+    }
+
+    return id;
+}
+
+bool SubscriptionIndex::Unsubscribe(uint64_t id) {
+    const auto it = subscriptions.find(id);
+    if (it == subscriptions.end() || it->second.view)
+        return false;
+
+    Erase(it);
+    return true;
+}
+
+bool SubscriptionIndex::DropView(uint64_t id) {
+    const auto it = subscriptions.find(id);
+    if (it == subscriptions.end() || !it->second.view)
+        return false;
+
+    Erase(it);
+    return true;
+}
+
+void SubscriptionIndex::Erase(std::map<uint64_t, Subscription>::iterator it) {
+    Subscription &subscription = it->second;
+    if (IsSingleEvent(subscription.events)) {
+        if (EraseFromIndex(by_event, subscription.events.from->event, &subscription))
+            bytes -= TreeNodeBytes<std::pair<const std::string, Subscription *>>();
+    } else if (EraseFromIndex(by_date, RangeStart(subscription.dates), &subscription)) {
+        bytes -= TreeNodeBytes<std::pair<const std::optional<Date>, Subscription *>>();
+    }
+
+    stale_views.erase(std::remove(stale_views.begin(), stale_views.end(), &subscription), stale_views.end());
+
+    bytes -= DeltaBytes(subscription.deltas) + TreeNodeBytes<std::pair<const uint64_t, Subscription>>();
+    if (const auto &view = subscription.view)
+        bytes -= view->matching_dates.size() * TreeNodeBytes<std::pair<const Date, int>>() + LatestBytes(view->result);
+    subscriptions.erase(it);
+}
+
+bool SubscriptionIndex::Empty() const {
+    return subscriptions.empty();
+}
+
+void SubscriptionIndex::Publish(bool added, const Date &date, std::string_view event) {
+    if (subscriptions.empty())
+        return;
+
+    // the signal pill matches past the event ranges, so every condition is evaluated for it
+    if (IsSignalPill(event)) {
+        for (auto &item : subscriptions) {
+            Match(item.second, added, date, event);
+        }
+        return;
+    }
+
+    const auto equal = by_event.equal_range(event);
+    for (auto it = equal.first; it != equal.second; ++it) {
+        Match(*it->second, added, date, event);
+    }
+
+    // unbounded starts come first, as nullopt orders before any date
+    for (auto it = by_date.begin(); it != by_date.end() && (!it->first || *it->first <= date); ++it) {
+        if (it->second->events.Contains(event))
+            Match(*it->second, added, date, event);
+    }
+}
+
+void SubscriptionIndex::Match(Subscription &subscription, bool added, const Date &date, std::string_view event) {
+    if (!subscription.dates.Contains(date) || !subscription.condition->Evaluate(date, event))
+        return;
+
+    if (subscription.view) {
+        Update(subscription, added, date, event);
+        return;
+    }
+
+    const size_t capacity = subscription.deltas.capacity();
+    subscription.deltas.push_back({added, date, std::string(event)});
+    bytes += (subscription.deltas.capacity() - capacity) * sizeof(SubscriptionDelta)
+             + StringHeapBytes(subscription.deltas.back().event);
+}
+
+void SubscriptionIndex::Update(Subscription &subscription, bool added, const Date &date, std::string_view event) {
+    View &view = *subscription.view;
+    auto &latest = view.result.latest;
+
+    if (added) {
+        view.result.count++;
+        if (view.matching_dates[date]++ == 0)
+            bytes += TreeNodeBytes<std::pair<const Date, int>>();
+
+        // events are appended to their date, so a new entry of the newest date is the last one
+        if (!latest || latest->first <= date) {
+            bytes -= LatestBytes(view.result);
+            latest.emplace(date, std::string(event));
+            bytes += LatestBytes(view.result);
+        }
+        return;
+    }
+
+    view.result.count--;
+    const auto it = view.matching_dates.find(date);
+    if (--it->second == 0) {
+        view.matching_dates.erase(it);
+        bytes -= TreeNodeBytes<std::pair<const Date, int>>();
+    }
+
+    // events of a date are distinct, the next latest entry is found once the change is complete
+    if (latest && latest->first == date && latest->second == event && !view.stale) {
+        view.stale = true;
+        stale_views.push_back(&subscription);
+    }
+}
+
+std::optional<std::vector<SubscriptionDelta>> SubscriptionIndex::Take(uint64_t id) {
+    const auto it = subscriptions.find(id);
+    if (it == subscriptions.end() || it->second.view)
+        return std::nullopt;
+
+    std::vector<SubscriptionDelta> deltas;
+    deltas.swap(it->second.deltas);
+    bytes -= DeltaBytes(deltas);
+
+    return deltas;
+}
+
+const ViewResult *SubscriptionIndex::ReadView(uint64_t id) const {
+    const auto it = subscriptions.find(id);
+    if (it == subscriptions.end() || !it->second.view)
+        return nullptr;
+
+    return &it->second.view->result;
+}
+
+void SubscriptionIndex::RefreshViews(
+        const std::function<std::optional<std::string>(const Date &, const Node &)> &last_match) {
+    for (Subscription *subscription : stale_views) {
+        View &view = *subscription->view;
+        view.stale = false;
+        bytes -= LatestBytes(view.result);
+        view.result.latest.reset();
+
+        for (auto it = view.matching_dates.rbegin(); it != view.matching_dates.rend(); ++it) {
+            if (auto event = last_match(it->first, *subscription->condition)) {
+                view.result.latest.emplace(it->first, std::move(*event));
+                bytes += LatestBytes(view.result);
+                break;
+            }
+        }
+    }
+
+    stale_views.clear();
+}
+
+size_t SubscriptionIndex::MemoryUsage() const {
+    return bytes;
+}
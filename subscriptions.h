@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "date.h"
+#include "node.h"
+
+// Entry which started (added) or stopped matching a subscribed condition
+struct SubscriptionDelta {
+    bool added;
+    Date date;
+    std::string event;
+};
+
+// Aggregates of the entries matching a view condition
+struct ViewResult {
+    int count = 0;
+    std::optional<std::pair<Date, std::string>> latest;     // the last one in Print order
+};
+
+// Conditions registered for continuous matching. Every added or removed entry is
+// evaluated only against the conditions it could satisfy: conditions which need a
+// single event are looked up by it, the others are ordered by the start of their date
+// range, so the ones starting after the date of the entry are never visited.
+// Matches of a subscription are queued until its subscriber takes them, matches of
+// a view update its aggregates in place. Subscriptions and views share ids.
+class SubscriptionIndex {
+public:
+    // Deltas start with the first change after subscribing
+    uint64_t Subscribe(std::shared_ptr<Node> condition);
+
+    // View of the condition starting from the aggregates of the current entries,
+    // matching_dates has the number of matching entries by date
+    uint64_t CreateView(std::shared_ptr<Node> condition, ViewResult result, std::map<Date, int> matching_dates);
+
+    // False for an unknown subscription
+    bool Unsubscribe(uint64_t id);
+
+    // False for an unknown view
+    bool DropView(uint64_t id);
+
+    bool Empty() const;
+
+    // Queues a delta for every subscription whose condition matches the entry
+    void Publish(bool added, const Date &date, std::string_view event);
+
+    // Deltas queued since the last call in the order of the changes, nullopt for an unknown subscription
+    std::optional<std::vector<SubscriptionDelta>> Take(uint64_t id);
+
+    // nullptr for an unknown view
+    const ViewResult *ReadView(uint64_t id) const;
+
+    // Views whose latest entry was removed get the last entry matching their condition
+    // on their newest matching date, as last_match finds it once all changes are made.
+    // A date where last_match finds nothing is passed over for the one before it.
+    void RefreshViews(const std::function<std::optional<std::string>(const Date &, const Node &)> &last_match);
+
+    size_t MemoryUsage() const;
+
+private:
+    struct View {
+        ViewResult result;
+        std::map<Date, int> matching_dates;
+        bool stale = false;         // the latest entry was removed
+    };
+
+    struct Subscription {
+        std::shared_ptr<Node> condition;
+        DateRange dates;
+        EventRange events;
+        std::vector<SubscriptionDelta> deltas;
+        std::optional<View> view;   // replaces the queue of deltas for a view
+    };
+
+    uint64_t Register(std::shared_ptr<Node> condition, std::optional<View> view);
+
+    void Erase(std::map<uint64_t, Subscription>::iterator subscription);
+
+    void Update(Subscription &subscription, bool added, const Date &date, std::string_view event);
+
+    // Queues a delta if the entry falls into the date range and matches the condition
+    void Match(Subscription &subscription, bool added, const Date &date, std::string_view event);
+
+    uint64_t next_id = 1;
+    std::map<uint64_t, Subscription> subscriptions;
+
+    // Conditions with a single event in their range, by the event
+    std::multimap<std::string, Subscription *, std::less<>> by_event;
+
+    // All other conditions which can match anything, by the start of their date range
+    std::multimap<std::optional<Date>, Subscription *> by_date;
+
+    std::vector<Subscription *> stale_views;
+
+    // heap bytes of the subscriptions, their index nodes, their queued deltas and the
+    // dates and latest entries of the views, kept up to date by every change so that
+    // reading them is cheap
+    size_t bytes = 0;
+};